@@ -0,0 +1,23 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// shared bits for the microbenchmarks, each bench links helper-function/request-handler.c directly
+#include <stdio.h>
+#include <time.h>
+#include "request-handler.h"
+
+// request-handler.c expects these from the server main it is linked into
+void reset_req_counter() {}
+int get_req_counter() { return 0; }
+void increment_req_counter() {}
+void add_to_iocbs(struct iocb *iocb) { (void)iocb; }
+void submit_iocbs(io_context_t ctx) { (void)ctx; }
+
+static inline double bench_now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+#endif
@@ -0,0 +1,103 @@
+// O_DIRECT GET chunk reads with and without the user-space block cache, skewed (80/20) chunk
+// popularity over a file bigger than one worker's share of BLOCK_CACHE_BUDGET
+// gcc -O2 -D_GNU_SOURCE -Ihelper-function bench/block_cache_bench.c helper-function/request-handler.c -luring -laio -lpthread -o block_cache_bench
+// ./block_cache_bench [file on a real disk, created if missing] [workers]
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bench.h"
+
+#define FILE_CHUNKS 4096 // 256mb at BUFFER_SIZE chunks
+#define READS 200000
+
+static off_t pick_chunk(unsigned *seed)
+{
+    // 80% of reads go to the first 20% of the file
+    unsigned r = rand_r(seed);
+    if (r % 100 < 80)
+        return (off_t)(r / 100 % (FILE_CHUNKS / 5)) * BUFFER_SIZE;
+    return (off_t)(r / 100 % FILE_CHUNKS) * BUFFER_SIZE;
+}
+
+static int make_file(const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+    {
+        perror("open");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)FILE_CHUNKS * BUFFER_SIZE)
+        return fd;
+    char *chunk = malloc(BUFFER_SIZE);
+    memset(chunk, 'x', BUFFER_SIZE);
+    for (int i = 0; i < FILE_CHUNKS; i++)
+    {
+        if (write(fd, chunk, BUFFER_SIZE) != BUFFER_SIZE)
+        {
+            perror("write");
+            return -1;
+        }
+    }
+    free(chunk);
+    fsync(fd);
+    return fd;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = argc > 1 ? argv[1] : "block_cache_bench.dat";
+    cache_set_workers(argc > 2 ? atoi(argv[2]) : 1);
+    int fd = make_file(path);
+    if (fd == -1)
+        return 1;
+    close(fd);
+    fd = open(path, O_RDONLY | O_DIRECT);
+    if (fd == -1)
+    {
+        perror("open O_DIRECT (tmpfs?)");
+        return 1;
+    }
+
+    conn_state *conn = conn_alloc(1);
+    conn->file_fd = fd;
+    conn->file_size = (off_t)FILE_CHUNKS * BUFFER_SIZE;
+    volatile long sink = 0;
+
+    unsigned seed = 1;
+    double t0 = bench_now();
+    for (int i = 0; i < READS; i++)
+        sink += pread(fd, conn->req_buffer, BUFFER_SIZE, pick_chunk(&seed));
+    double t1 = bench_now();
+
+    block_cache_bind(conn);
+    if (!conn->file_ino)
+    {
+        fprintf(stderr, "block cache disabled\n");
+        return 1;
+    }
+    seed = 1;
+    double t2 = bench_now();
+    for (int i = 0; i < READS; i++)
+    {
+        conn->byte_offset = pick_chunk(&seed);
+        size_t len = block_cache_read(conn, conn->req_buffer);
+        if (!len)
+        {
+            len = pread(fd, conn->req_buffer, BUFFER_SIZE, conn->byte_offset);
+            block_cache_store(conn, conn->byte_offset, conn->req_buffer, len);
+        }
+        sink += len;
+    }
+    double t3 = bench_now();
+
+    unsigned long hits, misses;
+    block_cache_stats(&hits, &misses);
+    printf("O_DIRECT pread only: %.1f us/read\n", (t1 - t0) / READS * 1e6);
+    printf("block cache + pread: %.1f us/read, hit rate %.1f%%\n", (t3 - t2) / READS * 1e6,
+           100.0 * hits / (hits + misses));
+    close(fd);
+    return 0;
+}
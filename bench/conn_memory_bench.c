@@ -0,0 +1,55 @@
+// resident memory of idle keep-alive conns: every conn owning a BUFFER_SIZE io buffer (the servers
+// without a buffer ring) vs bufferless conns plus the one BUF_RING_ENTRIES provided buffer pool.
+// socket memory in the kernel is the same in both and not counted
+// gcc -O2 -D_GNU_SOURCE -DCONN_TABLE_SLOTS=65536 -Ihelper-function bench/conn_memory_bench.c helper-function/request-handler.c -luring -laio -lpthread -o conn_memory_bench
+#include <stdlib.h>
+#include <sys/wait.h>
+#include "bench.h"
+
+static long rss_kb()
+{
+    long size, resident;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f || fscanf(f, "%ld %ld", &size, &resident) != 2)
+        resident = 0;
+    if (f)
+        fclose(f);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// runs in its own child so each figure starts from the same empty process
+static void measure(long conns, int own_buffer)
+{
+    pid_t pid = fork();
+    if (pid != 0)
+    {
+        waitpid(pid, NULL, 0);
+        return;
+    }
+    long before = rss_kb();
+    if (!own_buffer && !io_pool_map((size_t)BUF_RING_ENTRIES * BUFFER_SIZE, 1))
+        exit(1);
+    for (long i = 0; i < conns; i++)
+    {
+        conn_state *conn = conn_alloc(own_buffer);
+        if (!conn)
+            exit(1);
+        conn->fd = i; // a live conn has had its hot line written
+    }
+    long after = rss_kb();
+    printf("%6ld idle conns, %-24s %8.1f MB (%.2f KB/conn)\n", conns,
+           own_buffer ? "buffer per conn:" : "buffer ring, bufferless:", (after - before) / 1024.0,
+           (double)(after - before) / conns);
+    exit(0);
+}
+
+int main()
+{
+    long counts[] = {10000, 50000};
+    for (int i = 0; i < 2; i++)
+    {
+        measure(counts[i], 1);
+        measure(counts[i], 0);
+    }
+    return 0;
+}
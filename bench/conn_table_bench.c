@@ -0,0 +1,65 @@
+// conn churn: malloc'd conn_state per accept vs the conn_alloc slab, with a handle lookup per
+// completion the way the uring loops resolve user_data, over a set of live conns
+// gcc -O2 -D_GNU_SOURCE -Ihelper-function bench/conn_table_bench.c helper-function/request-handler.c -luring -laio -lpthread -o conn_table_bench
+// ./conn_table_bench [live conns, default and max the RLIMIT_NOFILE soft limit]
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+
+#define OPS 2000000
+#define LOOKUPS_PER_OP 4 // recv, send and a couple of other completions per conn turnover
+
+int main(int argc, char *argv[])
+{
+    struct rlimit nofile;
+    getrlimit(RLIMIT_NOFILE, &nofile);
+    long live = argc > 1 ? atol(argv[1]) : (long)nofile.rlim_cur;
+    if (live < 1 || live > (long)nofile.rlim_cur)
+        live = nofile.rlim_cur;
+    volatile long sink = 0;
+
+    conn_state **heap = malloc(live * sizeof(conn_state *));
+    for (long i = 0; i < live; i++)
+    {
+        heap[i] = calloc(1, sizeof(conn_state));
+        heap[i]->fd = i;
+    }
+    unsigned seed = 1;
+    double t0 = bench_now();
+    for (long op = 0; op < OPS; op++)
+    {
+        long victim = rand_r(&seed) % live;
+        free(heap[victim]);
+        heap[victim] = calloc(1, sizeof(conn_state));
+        heap[victim]->fd = victim;
+        for (int l = 0; l < LOOKUPS_PER_OP; l++)
+            sink += heap[rand_r(&seed) % live]->fd; // user_data was the pointer itself
+    }
+    double t1 = bench_now();
+
+    uint64_t *handles = malloc(live * sizeof(uint64_t));
+    for (long i = 0; i < live; i++)
+    {
+        conn_state *conn = conn_alloc(0);
+        conn->fd = i;
+        handles[i] = conn_handle(conn);
+    }
+    seed = 1;
+    double t2 = bench_now();
+    for (long op = 0; op < OPS; op++)
+    {
+        long victim = rand_r(&seed) % live;
+        conn_free(conn_lookup(handles[victim]));
+        conn_state *conn = conn_alloc(0);
+        conn->fd = victim;
+        handles[victim] = conn_handle(conn);
+        for (int l = 0; l < LOOKUPS_PER_OP; l++)
+            sink += conn_lookup(handles[rand_r(&seed) % live])->fd;
+    }
+    double t3 = bench_now();
+
+    printf("%ld live conns, %d lookups per turnover\n", live, LOOKUPS_PER_OP);
+    printf("calloc/free:          %.1f ns per turnover\n", (t1 - t0) / OPS * 1e9);
+    printf("conn_alloc/conn_free: %.1f ns per turnover\n", (t3 - t2) / OPS * 1e9);
+    return 0;
+}
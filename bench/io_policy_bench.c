@@ -0,0 +1,91 @@
+// buffered vs O_DIRECT GET streaming across file sizes, cold (page cache dropped) and hot (read
+// before), the numbers behind DIRECT_IO_MIN_SIZE and IO_HOT_HITS
+// gcc -O2 -D_GNU_SOURCE -Ihelper-function bench/io_policy_bench.c helper-function/request-handler.c -luring -laio -lpthread -o io_policy_bench
+// ./io_policy_bench [scratch dir on a real disk]
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bench.h"
+
+#define TOTAL_BYTES (512L * 1024 * 1024) // streamed per cell, small files are read repeatedly
+
+static char *buf;
+
+static int make_file(const char *path, off_t size)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        perror("open");
+        return -1;
+    }
+    memset(buf, 'x', BUFFER_SIZE);
+    for (off_t done = 0; done < size; done += BUFFER_SIZE)
+    {
+        if (write(fd, buf, BUFFER_SIZE) != BUFFER_SIZE)
+        {
+            perror("write");
+            close(fd);
+            return -1;
+        }
+    }
+    fsync(fd);
+    close(fd);
+    return 0;
+}
+
+// MB/s streaming the file in BUFFER_SIZE chunks until TOTAL_BYTES went by
+static double stream(const char *path, off_t size, int direct, int hot)
+{
+    long passes = TOTAL_BYTES / size;
+    if (passes < 1)
+        passes = 1;
+    double elapsed = 0;
+    for (long p = 0; p < passes; p++)
+    {
+        int fd = open(path, O_RDONLY | (direct ? O_DIRECT : 0));
+        if (fd == -1)
+        {
+            perror("open");
+            return 0;
+        }
+        if (!hot)
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        else if (!direct && p == 0)
+        {
+            for (off_t off = 0; off < size; off += BUFFER_SIZE) // warm the page cache
+                pread(fd, buf, BUFFER_SIZE, off);
+        }
+        double t0 = bench_now();
+        for (off_t off = 0; off < size; off += BUFFER_SIZE)
+        {
+            if (pread(fd, buf, BUFFER_SIZE, off) <= 0)
+                break;
+        }
+        elapsed += bench_now() - t0;
+        close(fd);
+    }
+    return (double)passes * size / elapsed / (1024 * 1024);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *dir = argc > 1 ? argv[1] : ".";
+    buf = io_buffer_get();
+    off_t sizes[] = {64 * 1024, 256 * 1024, 1024 * 1024, 16 * 1024 * 1024, 256 * 1024 * 1024};
+    char path[512];
+    snprintf(path, sizeof(path), "%s/io_policy_bench.dat", dir);
+
+    printf("%10s %14s %14s %14s %14s   (MB/s)\n", "size", "buffered cold", "direct cold", "buffered hot", "direct hot");
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+    {
+        if (make_file(path, sizes[i]) < 0)
+            return 1;
+        printf("%9ldk %14.0f %14.0f %14.0f %14.0f\n", (long)(sizes[i] / 1024),
+               stream(path, sizes[i], 0, 0), stream(path, sizes[i], 1, 0),
+               stream(path, sizes[i], 0, 1), stream(path, sizes[i], 1, 1));
+    }
+    unlink(path);
+    return 0;
+}
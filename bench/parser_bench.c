@@ -0,0 +1,80 @@
+// request header parsing: the old strstr + sscanf rescan vs the incremental parse_request,
+// with the header arriving whole, in 64 byte and in 16 byte recvs
+// gcc -O2 -D_GNU_SOURCE -Ihelper-function bench/parser_bench.c helper-function/request-handler.c -luring -laio -lpthread -o parser_bench
+#include <string.h>
+#include "bench.h"
+
+#define ITERATIONS 200000
+
+static char buf[BUFFER_SIZE];
+
+int main()
+{
+    // browser-sized header, ~600 bytes
+    int len = sprintf(buf,
+                      "PUT /upload/file.bin HTTP/1.1\r\n"
+                      "Host: localhost:8083\r\n"
+                      "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+                      "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+                      "Accept-Language: en-US,en;q=0.5\r\n"
+                      "Accept-Encoding: gzip, deflate, br\r\n"
+                      "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark; other=%0200d\r\n"
+                      "Connection: keep-alive\r\n"
+                      "Content-Length: 65536\r\n\r\n",
+                      0);
+    int steps[] = {0, 64, 16};
+    volatile long sink = 0;
+
+    for (int s = 0; s < 3; s++)
+    {
+        int step = steps[s] ? steps[s] : len;
+
+        // what the servers did before: rescan everything received so far on every recv
+        double t0 = bench_now();
+        for (int it = 0; it < ITERATIONS; it++)
+        {
+            char method[16], path[1024];
+            long content_length = 0;
+            for (int n = step;; n += step)
+            {
+                if (n > len)
+                    n = len;
+                char saved = buf[n];
+                buf[n] = '\0';
+                char *end = strstr(buf, "\r\n\r\n");
+                buf[n] = saved;
+                if (end)
+                {
+                    sscanf(buf, "%15s %1023s", method, path);
+                    char *cl = strstr(buf, "Content-Length: ");
+                    if (cl)
+                        sscanf(cl, "Content-Length: %ld", &content_length);
+                    sink += content_length + method[0];
+                    break;
+                }
+            }
+        }
+
+        double t1 = bench_now();
+        for (int it = 0; it < ITERATIONS; it++)
+        {
+            http_parser parser;
+            memset(&parser, 0, sizeof(parser));
+            for (int n = step;; n += step)
+            {
+                if (n > len)
+                    n = len;
+                if (parse_request(&parser, buf, n) == PARSE_DONE)
+                {
+                    sink += parser.req.content_length.len + parser.req.method.ptr[0];
+                    break;
+                }
+            }
+        }
+        double t2 = bench_now();
+
+        printf("header %d bytes, recv step %d: strstr+sscanf %.0f ns/req, parse_request %.0f ns/req\n",
+               len, step, (t1 - t0) / ITERATIONS * 1e9, (t2 - t1) / ITERATIONS * 1e9);
+    }
+    return 0;
+}
@@ -0,0 +1,101 @@
+// SQE submission: io_uring_submit per SQE vs once per drained CQ batch vs the adaptive
+// submit_policy, on a real ring with NOP SQEs standing in for the follow-up ops a loop queues
+// while handling completions. reports submit syscalls per SQE and how long SQEs sat queued
+// gcc -O2 -D_GNU_SOURCE -Ihelper-function bench/submit_policy_bench.c helper-function/request-handler.c -luring -laio -lpthread -o submit_policy_bench
+#include <stdlib.h>
+#include "bench.h"
+
+#define SQES 1000000
+#define RING_ENTRIES 1024
+#define WORK_NS 500 // handling one completion, between queueing its SQE and the next one
+
+enum
+{
+    EAGER,
+    DRAIN,
+    ADAPTIVE
+};
+static const char *policy_names[] = {"submit per SQE", "submit per drain", "submit_policy"};
+
+static struct io_uring ring;
+static double queued_at[RING_ENTRIES];
+static int queued = 0;
+static double delay_total = 0;
+static unsigned long submits = 0;
+
+static void spin_ns(long ns)
+{
+    double until = bench_now() + ns * 1e-9;
+    while (bench_now() < until)
+        ;
+}
+
+static void reap()
+{
+    struct io_uring_cqe *cqe;
+    while (io_uring_peek_cqe(&ring, &cqe) == 0)
+        io_uring_cqe_seen(&ring, cqe);
+}
+
+static void submitted(int ret)
+{
+    if (ret <= 0)
+        return;
+    double now = bench_now();
+    for (int i = 0; i < queued; i++)
+        delay_total += now - queued_at[i];
+    queued = 0;
+    submits++;
+}
+
+// burst: completions handled per loop iteration before the CQ is drained
+static void run(int policy, int burst)
+{
+    if (io_uring_queue_init(RING_ENTRIES, &ring, 0) < 0)
+    {
+        perror("io_uring_queue_init");
+        exit(1);
+    }
+    submit_policy_reset();
+    delay_total = 0;
+    submits = 0;
+    queued = 0;
+
+    double t0 = bench_now();
+    for (long done = 0; done < SQES;)
+    {
+        for (int i = 0; i < burst && done < SQES; i++, done++)
+        {
+            spin_ns(WORK_NS);
+            io_uring_prep_nop(io_uring_get_sqe(&ring));
+            queued_at[queued++] = bench_now();
+            if (policy == EAGER)
+                submitted(io_uring_submit(&ring));
+            else if (policy == ADAPTIVE)
+            {
+                submit_policy_queued();
+                submitted(submit_policy_flush(&ring, 0));
+            }
+        }
+        // CQ drained, nothing else would join the batch
+        if (policy == ADAPTIVE)
+            submitted(submit_policy_flush(&ring, 1));
+        else if (queued > 0)
+            submitted(io_uring_submit(&ring));
+        reap();
+    }
+    double elapsed = bench_now() - t0;
+    io_uring_queue_exit(&ring);
+
+    printf("burst %3d  %-17s %7.3f submits/SQE  %7.1f us mean queued  %6.0f ns/SQE\n", burst,
+           policy_names[policy], (double)submits / SQES, delay_total / SQES * 1e6, elapsed / SQES * 1e9);
+}
+
+int main()
+{
+    int bursts[] = {1, 8, 64, 512};
+    for (int b = 0; b < 4; b++)
+        for (int policy = EAGER; policy <= ADAPTIVE; policy++)
+            run(policy, bursts[b]);
+    return 0;
+}
@@ -1,6 +1,14 @@
 // request_handler.c
 #include "request-handler.h"
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h> // for the header terminator scan
+#endif
+#include <stdatomic.h>     // for the file ring poller handoff
+#include <linux/futex.h>   // for the file ring poller's idle sleep
+#include <sys/syscall.h>
+#include <dirent.h>          // for finding a file to probe the file ring with
+
 off_t get_file_size(int fd)
 {
     struct stat st;
@@ -21,27 +29,68 @@ size_t align_to_block(size_t size)
 void send_response(int client_socket, const char *status, const char *content_type, const char *body)
 {
     char response[BUFFER_SIZE];
-    snprintf(response, sizeof(response),
-             "%s\r\nContent-Type: %s\r\n\r\n%s", status, content_type, body);
-
+    int len;
     if (body)
-    {
-        int content_length = strlen(body);
-        snprintf(response, sizeof(response),
-                 "%s\r\nContent-Type: %s\r\nContent-Length: %d\r\n\r\n%s",
-                 status, content_type, content_length, body);
-        send(client_socket, response, strlen(response), 0);
-    }
+        len = snprintf(response, sizeof(response),
+                       "%s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n%s",
+                       status, content_type, strlen(body), body);
     else
-    {
         // When there's no body, don't include Content-Length
-        snprintf(response, sizeof(response),
-                 "%s\r\nContent-Type: %s\r\n\r\n",
-                 status, content_type);
-        send(client_socket, response, strlen(response), 0);
+        len = snprintf(response, sizeof(response),
+                       "%s\r\nContent-Type: %s\r\n\r\n",
+                       status, content_type);
+    if (len >= (int)sizeof(response))
+        len = sizeof(response) - 1;
+    send(client_socket, response, len, 0);
+}
+
+static const struct
+{
+    const char *status;
+    const char *body;
+} static_response_text[STATIC_RESP_COUNT] = {
+    [RESP_FILE_SENT] = {"HTTP/1.1 200 OK", "File sent."},
+    [RESP_CREATED] = {"HTTP/1.1 201 Created", "File uploaded."},
+    [RESP_MALFORMED] = {"HTTP/1.1 400 Bad Request", "Malformed Request."},
+    [RESP_BAD_CONTENT_LENGTH] = {"HTTP/1.1 400 Bad Request", "Bad Content-Length."},
+    [RESP_CLIENT_DISCONNECTED] = {"HTTP/1.1 400 Bad Request", "Client Disconnected"},
+    [RESP_HEADER_TOO_LARGE] = {"HTTP/1.1 400 Bad Request", "Header too large."},
+    [RESP_BAD_UPLOAD_PATH] = {"HTTP/1.1 400 Bad Request", "Invalid upload path."},
+    [RESP_NOT_FOUND] = {"HTTP/1.1 404 Not Found", "File not found"},
+    [RESP_METHOD_NOT_ALLOWED] = {"HTTP/1.1 405 Method Not Allowed", "Method Not Allowed."},
+    [RESP_LENGTH_REQUIRED] = {"HTTP/1.1 411 Length Required", "Content-Length required."},
+    [RESP_INTERNAL_ERROR] = {"HTTP/1.1 500 Internal Server Error", "Internal Server Error"},
+    [RESP_FILE_SIZE_ERROR] = {"HTTP/1.1 500 Internal Server Error", "Could not get file size."},
+    [RESP_REQUEST_ERROR] = {"HTTP/1.1 500 Internal Server Error", "Error completing the request."},
+    [RESP_FILE_IO_ERROR] = {"HTTP/1.1 500 Internal Server Error", "File I/O Error."},
+    [RESP_FILE_WRITE_ERROR] = {"HTTP/1.1 500 Internal Server Error", "File write error (0 bytes written)."},
+    [RESP_REQUEST_TIMEOUT] = {"HTTP/1.1 408 Request Timeout", "Request not received in time."},
+};
+
+// rendered once and only read afterwards, so every thread and forked worker shares them
+static char static_responses[STATIC_RESP_COUNT][STATIC_RESP_MAX];
+static size_t static_response_len[STATIC_RESP_COUNT];
+
+void init_static_responses()
+{
+    for (int i = 0; i < STATIC_RESP_COUNT; i++)
+    {
+        int len = snprintf(static_responses[i], STATIC_RESP_MAX,
+                           "%s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n\r\n%s",
+                           static_response_text[i].status, strlen(static_response_text[i].body),
+                           static_response_text[i].body);
+        static_response_len[i] = len < STATIC_RESP_MAX ? len : STATIC_RESP_MAX - 1;
     }
 }
 
+// same bytes send_response() would build, without formatting anything per request
+void send_static_response(int client_socket, static_response resp)
+{
+    if (static_response_len[resp] == 0)
+        init_static_responses(); // a server that skipped the startup call
+    send(client_socket, static_responses[resp], static_response_len[resp], 0);
+}
+
 const char *get_mime_type(const char *path)
 {
     if (strstr(path, ".jpg") || strstr(path, ".jpeg"))
@@ -58,339 +107,1728 @@ const char *get_mime_type(const char *path)
         return "application/octet-stream"; // Default for unknown types
 }
 
-int handle_get_header(int client_socket, char *path, int *file_fd,
-                      off_t *file_size, server_type s_type)
+// offset of the next '\n' in buf[pos, end), end if there is none
+static size_t scan_lf(const char *buf, size_t pos, size_t end)
 {
-    char full_path[2048];
-
-    // check if the path is just "/"
-    snprintf(full_path, sizeof(full_path), "%s%s", ROOT, path);
-    if (strcmp(path, "/") == 0)
+#if defined(__AVX2__)
+    const __m256i lf32 = _mm256_set1_epi8('\n');
+    for (; pos + 32 <= end; pos += 32)
     {
-        snprintf(full_path, sizeof(full_path), "%s/server-index.html", ROOT);
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(buf + pos));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, lf32));
+        if (mask)
+            return pos + __builtin_ctz(mask);
     }
-
-    // open w O_DIRECT
-    if (s_type == NON_BLOCKING)
-        *file_fd = open(full_path, O_RDONLY | O_DIRECT | O_NONBLOCK); // remove O_DIRECT for buffered io
-    else
-        *file_fd = open(full_path, O_RDONLY | O_DIRECT);
-
-    if (*file_fd == -1)
+#endif
+#if defined(__SSE2__)
+    const __m128i lf16 = _mm_set1_epi8('\n');
+    for (; pos + 16 <= end; pos += 16)
     {
-        fprintf(stderr, "File not found: %s\n", strerror(errno));
-        send_response(client_socket, "HTTP/1.1 404 Not Found", "text/plain", "File not found");
-        return CONN_CLOSED;
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(buf + pos));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, lf16));
+        if (mask)
+            return pos + __builtin_ctz(mask);
     }
-
-    // get file size
-    *file_size = get_file_size(*file_fd);
-    if (*file_size == -1)
+#endif
+    // scalar tail, or the whole scan without SIMD
+    for (; pos < end; pos++)
     {
-        fprintf(stderr, "Couldnt get file size: %s\n", strerror(errno));
-        send_response(client_socket, "HTTP/1.1 500 Internal Server Error", "text/plain", "Could not get file size.");
-        return CONN_ERROR;
+        if (buf[pos] == '\n')
+            return pos;
     }
+    return end;
+}
 
-    // get the MIME type
-    const char *mime_type = get_mime_type(full_path);
-    // printf("mime_type is: %s\n", mime_type);
+int slice_eq(http_slice s, const char *str)
+{
+    size_t len = strlen(str);
+    return s.len == len && memcmp(s.ptr, str, len) == 0;
+}
 
-    // construct and send the HTTP header
-    char header[BUFFER_SIZE];
-    snprintf(header, sizeof(header),
-             "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %ld\r\n\r\n",
-             mime_type, *file_size);
-    send(client_socket, header, strlen(header), 0);
-    return CONN_ALIVE;
+// case insensitive match of a header name, name_len excludes the ':'
+static int header_is(const char *name, size_t name_len, const char *want)
+{
+    return name_len == strlen(want) && strncasecmp(name, want, name_len) == 0;
 }
 
-int handle_put_header(int client_socket, char *path, int *file_fd,
-                      off_t *file_size, char *req_buffer, server_type s_type)
+// METHOD SP path SP version
+static parse_status parse_request_line(http_request *req, const char *line, size_t len)
 {
-    char file_path[2048];
+    const char *end = line + len;
+    const char *sp1 = memchr(line, ' ', len);
+    if (!sp1 || sp1 == line)
+        return PARSE_BAD;
+    const char *sp2 = memchr(sp1 + 1, ' ', end - sp1 - 1);
+    if (!sp2 || sp2 == sp1 + 1 || sp2 + 1 == end)
+        return PARSE_BAD;
+    req->method = (http_slice){line, sp1 - line};
+    req->path = (http_slice){sp1 + 1, sp2 - sp1 - 1};
+    req->version = (http_slice){sp2 + 1, end - sp2 - 1};
+    return PARSE_INCOMPLETE;
+}
 
-    // Check if the path starts with "/upload"
-    if (strncmp(path, "/upload", 7) != 0)
-    {
-        fprintf(stderr, "Invalid upload path: %s\n", path);
-        send_response(client_socket, "HTTP/1.1 400 Bad Request", "text/plain", "Invalid upload path.");
-        return CONN_CLOSED;
-    }
+// name: value, only the headers the handlers use are kept
+static parse_status parse_header_line(http_request *req, const char *line, size_t len)
+{
+    const char *colon = memchr(line, ':', len);
+    if (!colon || colon == line)
+        return PARSE_BAD;
+    size_t name_len = colon - line;
+    const char *value = colon + 1;
+    const char *end = line + len;
+    while (value < end && (*value == ' ' || *value == '\t'))
+        value++;
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    http_slice slice = {value, end - value};
 
-    // get content length
-    char *cl_header = strstr(req_buffer, "Content-Length: ");
-    if (!cl_header)
+    if (header_is(line, name_len, "Content-Length"))
+        req->content_length = slice;
+    else if (header_is(line, name_len, "Connection"))
+        req->connection = slice;
+    else if (header_is(line, name_len, "Range"))
+        req->range = slice;
+    else if (header_is(line, name_len, "Host"))
+        req->host = slice;
+    else if (header_is(line, name_len, "If-None-Match"))
+        req->if_none_match = slice;
+    return PARSE_INCOMPLETE;
+}
+
+// parses the complete lines in buf[0, len), picks up where the last call stopped
+parse_status parse_request(http_parser *parser, const char *buf, size_t len)
+{
+    http_request *req = &parser->req;
+    while (parser->scan_pos < len)
     {
-        fprintf(stderr, "Content-Length header not found\n");
-        send_response(client_socket, "HTTP/1.1 411 Length Required", "text/plain", "Content-Length required.");
-        return CONN_CLOSED;
-    }
-    sscanf(cl_header, "Content-Length: %ld", file_size);
+        size_t lf = scan_lf(buf, parser->scan_pos, len);
+        if (lf == len)
+        {
+            parser->scan_pos = len; // partial line, only the new bytes get scanned next time
+            return PARSE_INCOMPLETE;
+        }
 
-    // constructing file path under ROOT/uploads/
-    snprintf(file_path, sizeof(file_path), "%s/uploads%s", ROOT, path + 7);
-    // printf("Trying to create file at: %s\n", file_path);
+        const char *line = buf + parser->line_start;
+        size_t line_len = lf - parser->line_start;
+        if (line_len > 0 && line[line_len - 1] == '\r')
+            line_len--;
+        parser->line_start = parser->scan_pos = lf + 1;
 
-    // open file for writing
-    if (s_type == NON_BLOCKING)
-        *file_fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT | O_NONBLOCK, 0644);
-    else
-        *file_fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
-    if (*file_fd == -1)
-    {
-        fprintf(stderr, "Error creating file: %s\n", strerror(errno));
-        return CONN_ERROR;
+        parse_status status;
+        if (req->method.len == 0)
+        {
+            if (line_len == 0)
+                continue; // stray CRLF between pipelined requests
+            status = parse_request_line(req, line, line_len);
+        }
+        else if (line_len == 0)
+        {
+            req->header_len = lf + 1;
+            return PARSE_DONE;
+        }
+        else
+            status = parse_header_line(req, line, line_len);
+        if (status == PARSE_BAD)
+            return PARSE_BAD;
     }
+    return PARSE_INCOMPLETE;
+}
 
-    return CONN_ALIVE;
+// HTTP/1.1 conns stay open unless the client says otherwise, HTTP/1.0 only on request
+int wants_keep_alive(const http_request *req)
+{
+    int keep_alive = slice_eq(req->version, "HTTP/1.1");
+    if (req->connection.len == 5 && strncasecmp(req->connection.ptr, "close", 5) == 0)
+        keep_alive = 0;
+    else if (req->connection.len == 10 && strncasecmp(req->connection.ptr, "keep-alive", 10) == 0)
+        keep_alive = 1;
+    return keep_alive;
 }
 
-ssize_t send_fully(int fd, const void *buf, size_t to_send, server_type s_type)
+// per thread so worker threads never share a slot, in-flight conns keep evicted entries alive through refs
+static __thread file_cache_entry *fd_cache[FD_CACHE_SLOTS];
+static __thread unsigned long fd_cache_hits = 0;
+static __thread unsigned long fd_cache_misses = 0;
+
+static time_t coarse_now()
 {
-    ssize_t sent = 0;
-    while (sent < to_send)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+// FNV-1a
+static uint32_t path_hash(const char *path)
+{
+    uint32_t hash = 2166136261u;
+    for (; *path; path++)
+        hash = (hash ^ (unsigned char)*path) * 16777619u;
+    return hash;
+}
+
+static unsigned fd_cache_slot(const char *path)
+{
+    return path_hash(path) & (FD_CACHE_SLOTS - 1);
+}
+
+// stat() disagrees with what was cached
+static int file_changed(const char *path, ino_t ino, off_t size, struct timespec mtime)
+{
+    struct stat st;
+    return stat(path, &st) == -1 || st.st_ino != ino || st.st_size != size ||
+           st.st_mtim.tv_sec != mtime.tv_sec || st.st_mtim.tv_nsec != mtime.tv_nsec;
+}
+
+static void drop_file_slot(int slot);
+
+static void fd_cache_release(file_cache_entry *entry)
+{
+    if (--entry->refs > 0)
+        return;
+    drop_file_slot(entry->file_slot);
+    close(entry->fd);
+    free(entry->path);
+    free(entry);
+}
+
+static void fd_cache_evict(unsigned slot)
+{
+    file_cache_entry *entry = fd_cache[slot];
+    fd_cache[slot] = NULL;
+    if (entry)
+        fd_cache_release(entry);
+}
+
+// returns a ref the caller must put_file(), NULL on miss or when the file changed on disk.
+// without may_block an entry due for its stat() is a miss, the caller revalidates asynchronously
+static file_cache_entry *fd_cache_get(const char *path, int may_block)
+{
+    unsigned slot = fd_cache_slot(path);
+    file_cache_entry *entry = fd_cache[slot];
+    if (!entry || strcmp(entry->path, path) != 0)
     {
-        ssize_t n = send(fd, (char *)buf + sent, to_send - sent, 0);
-        if (n == -1)
+        fd_cache_misses++;
+        return NULL;
+    }
+
+    time_t now = coarse_now();
+    if (now - entry->checked_at >= FD_CACHE_TTL_S)
+    {
+        if (!may_block)
         {
-            if (errno == EINTR)
-            {
-                continue; // Retry
-            }
-            // for eagain and ewouldblock
-            if (s_type == NON_BLOCKING && (errno == EAGAIN || errno == EWOULDBLOCK))
-                return sent;
-            perror("Couldnt send: \n");
-            return -1; // Real error
+            fd_cache_misses++;
+            return NULL;
         }
-        sent += n;
+        if (file_changed(path, entry->ino, entry->size, entry->mtime))
+        {
+            fd_cache_evict(slot);
+            fd_cache_misses++;
+            return NULL;
+        }
+        entry->checked_at = now;
     }
-    return sent;
+    fd_cache_hits++;
+    entry->refs++;
+    return entry;
 }
 
-ssize_t write_fully(int fd, const void *buf, size_t to_write, server_type s_type)
+// hands fd to the cache, NULL if the entry couldn't be allocated and the caller still owns fd
+static file_cache_entry *fd_cache_put(const char *path, int fd, const struct stat *st, int direct_io,
+                                      const char *mime_type, const char *header, size_t header_len)
 {
-    ssize_t written = 0;
-    to_write = align_to_block(to_write);
-    while (written < to_write)
+    if (header_len >= sizeof(((file_cache_entry *)0)->header))
+        return NULL;
+    file_cache_entry *entry = malloc(sizeof(file_cache_entry));
+    if (!entry)
+        return NULL;
+    entry->path = strdup(path);
+    if (!entry->path)
     {
-        ssize_t n = write(fd, (char *)buf + written, to_write - written);
-        if (n == -1)
-        {
-            if (errno == EINTR)
-            {
-                continue; // Retry
-            }
-            // for eagain and ewouldblock
-            if (s_type == NON_BLOCKING && (errno == EAGAIN || errno == EWOULDBLOCK))
-                return written;
-            perror("Couldnt write: \n");
-            return -1; // Real error
-        }
-        written += n;
+        free(entry);
+        return NULL;
     }
-    return written;
+    entry->fd = fd;
+    entry->size = st->st_size;
+    entry->ino = st->st_ino;
+    entry->mtime = st->st_mtim;
+    entry->direct_io = direct_io;
+    entry->checked_at = coarse_now();
+    entry->mime_type = mime_type;
+    memcpy(entry->header, header, header_len);
+    entry->header_len = header_len;
+    entry->refs = 2; // slot + caller
+    entry->file_slot = -1;
+
+    unsigned slot = fd_cache_slot(path);
+    fd_cache_evict(slot);
+    fd_cache[slot] = entry;
+    return entry;
 }
 
-int handle_blocking_requests(int client_socket, int *file_fd, char *req_buffer)
+// a PUT rewrote path, stop serving the old entry from this thread's cache
+void fd_cache_invalidate(const char *path)
 {
-    off_t file_size;
-    char method[8], path[1024];
-    ssize_t n;
+    unsigned slot = fd_cache_slot(path);
+    if (fd_cache[slot] && strcmp(fd_cache[slot]->path, path) == 0)
+        fd_cache_evict(slot);
+}
 
-    // read incoming request
-    n = recv(client_socket, req_buffer, BUFFER_SIZE, 0);
-    if (n < 0)
-    {
-        perror("Client sent nothing");
-        send_response(client_socket, "HTTP/1.1 400 Bad Request", "text/plain", "Malformed Request.");
-        return CONN_CLOSED;
-    }
-    if (n == 0)
-    {
-        perror("Client disconnected");
-        send_response(client_socket, "HTTP/1.1 400 Bad Request", "text/plain", "Client Disconnected");
-        return CONN_CLOSED;
-    }
+void fd_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+    *hits = fd_cache_hits;
+    *misses = fd_cache_misses;
+}
 
-    // if we have full header request
-    if (strstr(req_buffer, "\r\n\r\n"))
-    {
+// done with the request's file, drops the cache ref or closes a private fd
+void put_file(int *file_fd, file_cache_entry **entry)
+{
+    if (*entry)
+        fd_cache_release(*entry);
+    else if (*file_fd != -1)
+        close(*file_fd);
+    *entry = NULL;
+    *file_fd = -1;
+}
 
-        // extract method and path from the request string
-        sscanf(req_buffer, "%s %s", method, path);
-        // printf("Received request:\n%s %s\n", method, path);
+// complete small-file response, header and body back to back so a hit is one send
+typedef struct resp_cache_entry
+{
+    char *path;
+    uint32_t hash;
+    char *base;   // aligned allocation, the body starts on a block boundary for O_DIRECT reads
+    char *data;   // header followed by body
+    size_t len;
+    size_t charge; // bytes counted against the budget
+    off_t size;
+    ino_t ino;
+    struct timespec mtime;
+    time_t checked_at;
+    uint8_t freq; // hits since insert or last main queue pass, capped at 3
+    int dead;     // invalidated, freed once it reaches the head of its queue
+    struct resp_cache_entry *bucket_next;
+    struct resp_cache_entry *queue_next;
+} resp_cache_entry;
 
-        // Handle GET method
-        if (strcmp(method, "GET") == 0)
-        {
-            int res = handle_get_header(client_socket, path, &file_fd,
-                                        &file_size, BLOCKING);
-            if (res == CONN_ERROR)
-            {
-                perror("error completing get_header");
-                return CONN_ERROR;
-            }
-            else if (res == CONN_CLOSED)
-            {
-                perror("issue in client's req");
-                return CONN_CLOSED;
-            }
+typedef struct
+{
+    resp_cache_entry *head, *tail;
+    size_t bytes;
+} resp_queue;
 
-            memset(req_buffer, 0, BUFFER_SIZE); // use the req_buffer as send buffer
-            off_t byte_offset = 0;
-            while (byte_offset < file_size)
-            {
-                size_t remaining = file_size - byte_offset;
-                ssize_t bytes_read = pread(*file_fd, req_buffer, BUFFER_SIZE, byte_offset);
-                if (bytes_read == -1)
-                {
-                    perror("PREAD FAILED in GET ");
-                    return CONN_ERROR;
-                }
+// S3-FIFO: new entries go through a small probation queue, only re-referenced ones reach main,
+// so one-off scans can't flush the hot set. ghost remembers recent small queue evictions
+static __thread resp_cache_entry *resp_buckets[RESP_CACHE_BUCKETS];
+static __thread resp_queue resp_small, resp_main;
+static __thread uint32_t resp_ghost[RESP_CACHE_BUCKETS];
+static __thread size_t resp_cache_bytes = 0;
+static __thread unsigned long resp_cache_hits = 0;
+static __thread unsigned long resp_cache_misses = 0;
 
-                ssize_t sent = send_fully(client_socket, req_buffer, bytes_read, BLOCKING);
-                if (sent == -1)
-                {
-                    perror("Error sending blocking data");
-                    return CONN_ERROR;
-                }
-                // printf("bytes_read=%zd, sent=%zd, file_size=%zd \n", bytes_read, sent, file_size);
-                byte_offset += sent;
-            }
-            return CONN_CLOSED;
-        }
-        // Handle PUT method
-        else if (strcmp(method, "PUT") == 0)
-        {
-            char *body_start = strstr(req_buffer, "\r\n\r\n");
-            if (!body_start)
-            {
-                send_response(client_socket, "HTTP/1.1 400 Bad Request", "text/plain", "Malformed headers.");
-                return CONN_CLOSED;
-            }
-            int res = handle_put_header(client_socket, path, file_fd, &file_size, req_buffer, BLOCKING);
-            if (res == CONN_ERROR)
-            {
-                perror("error completing put_header");
-                return CONN_ERROR;
-            }
-            else if (res == CONN_CLOSED)
-            {
-                perror("issue in client's req");
-                return CONN_CLOSED;
-            }
-            body_start += 4; // Skip past the "\r\n\r\n"
-            size_t initial_body_len = n - (body_start - req_buffer);
-            if (initial_body_len < 0)
-                initial_body_len = 0;
-            off_t byte_offset = 0;
-            if (initial_body_len > 0)
-            {
-                // move the content to the start
-                memmove(req_buffer, body_start, initial_body_len);
+// workers sharing RESP_CACHE_BUDGET and BLOCK_CACHE_BUDGET, set by the server before any worker starts
+static int cache_workers = 1;
 
-                if (initial_body_len >= file_size)
-                {
-                    ssize_t written = write_fully(*file_fd, req_buffer, BUFFER_SIZE, BLOCKING);
-                    if (written == -1)
-                        return CONN_ERROR;
-                    byte_offset += written;
+void cache_set_workers(int workers)
+{
+    cache_workers = workers > 0 ? workers : 1;
+}
 
-                    if (byte_offset >= file_size)
-                    {
-                        send_response(client_socket, "HTTP/1.1 201 Created", "text/plain", "File uploaded.");
-                        return CONN_CLOSED;
-                    }
-                    return CONN_ERROR;
-                }
-                else
-                {
-                    // set rest values as 0
-                    memset(req_buffer + initial_body_len, 0, BUFFER_SIZE - initial_body_len);
-                }
-            }
-            size_t bytes_read = initial_body_len;
-            // printf("bytes_read=%zd, byte_offset=%zd, file_size=%zd \n", bytes_read, byte_offset, file_size);
-            while (byte_offset < file_size)
-            {
-                size_t bytes_recvd = recv(client_socket, req_buffer + bytes_read, BUFFER_SIZE - bytes_read, 0);
-                bytes_read += bytes_recvd;
-                if (bytes_recvd < 0)
-                {
-                    perror("Client stopped sending");
-                    send_response(client_socket, "HTTP/1.1 400 Bad Request", "text/plain", "Malformed Request.");
-                    return CONN_CLOSED;
-                }
-                if (bytes_recvd == 0)
-                {
-                    perror("Client disconnected");
-                    send_response(client_socket, "HTTP/1.1 400 Bad Request", "text/plain", "Client Disconnected");
-                    return CONN_CLOSED;
-                }
-                if (bytes_read < BUFFER_SIZE)
-                {
-                    memset(req_buffer + bytes_read, 0, BUFFER_SIZE - bytes_read);
-                    if (byte_offset + bytes_read < file_size)
-                    {
-                        continue;
-                    }
-                }
+static size_t resp_cache_budget()
+{
+    return RESP_CACHE_BUDGET / cache_workers;
+}
 
-                ssize_t written = write_fully(*file_fd, req_buffer, BUFFER_SIZE, BLOCKING);
-                if (written == -1)
-                    return CONN_ERROR;
-                byte_offset += written;
-                // printf("bytes_recvd=%zd, bytes_read=%zd, byte_offset=%zd, file_size=%zd \n", bytes_recvd, bytes_read, byte_offset, file_size);
-                bytes_read = 0;
-            }
-            if (byte_offset >= file_size)
-            {
-                send_response(client_socket, "HTTP/1.1 201 Created", "text/plain", "File uploaded.");
-                return CONN_CLOSED;
-            }
-            return CONN_ERROR;
-        }
+static void resp_queue_push(resp_queue *queue, resp_cache_entry *entry)
+{
+    entry->queue_next = NULL;
+    if (queue->tail)
+        queue->tail->queue_next = entry;
+    else
+        queue->head = entry;
+    queue->tail = entry;
+    queue->bytes += entry->charge;
+}
 
-        else
+static resp_cache_entry *resp_queue_pop(resp_queue *queue)
+{
+    resp_cache_entry *entry = queue->head;
+    queue->head = entry->queue_next;
+    if (!queue->head)
+        queue->tail = NULL;
+    queue->bytes -= entry->charge;
+    return entry;
+}
+
+static void resp_unlink(resp_cache_entry *entry)
+{
+    resp_cache_entry **link = &resp_buckets[entry->hash & (RESP_CACHE_BUCKETS - 1)];
+    while (*link != entry)
+        link = &(*link)->bucket_next;
+    *link = entry->bucket_next;
+    entry->dead = 1;
+}
+
+static void resp_free(resp_cache_entry *entry)
+{
+    if (!entry->dead)
+        resp_unlink(entry);
+    resp_cache_bytes -= entry->charge;
+    free(entry->base);
+    free(entry->path);
+    free(entry);
+}
+
+static void resp_evict_one()
+{
+    if (resp_small.head && (resp_small.bytes > resp_cache_budget() / 10 || !resp_main.head))
+    {
+        resp_cache_entry *entry = resp_queue_pop(&resp_small);
+        if (!entry->dead && entry->freq > 1)
         {
-            // Unsupported method
-            send_response(client_socket, "HTTP/1.1 405 Method Not Allowed", "text/plain", "Method Not Allowed.");
-            return CONN_CLOSED;
+            entry->freq = 0;
+            resp_queue_push(&resp_main, entry); // proved itself during probation
+            return;
         }
+        if (!entry->dead)
+            resp_ghost[entry->hash & (RESP_CACHE_BUCKETS - 1)] = entry->hash;
+        resp_free(entry);
+        return;
     }
-    return CONN_CLOSED;
+    resp_cache_entry *entry = resp_queue_pop(&resp_main);
+    if (!entry->dead && entry->freq > 0)
+    {
+        entry->freq--;
+        resp_queue_push(&resp_main, entry); // second chance
+        return;
+    }
+    resp_free(entry);
 }
 
-int verify_alignment(conn_state *conn)
+static resp_cache_entry *resp_cache_lookup(const char *path, uint32_t hash)
 {
-    // Verify buffer alignment
-    if ((uintptr_t)conn->buffer % BLOCK_SIZE != 0)
+    resp_cache_entry *entry = resp_buckets[hash & (RESP_CACHE_BUCKETS - 1)];
+    for (; entry; entry = entry->bucket_next)
     {
-        perror("Error: Buffer not aligned to block size ");
-        return CONN_ERROR;
+        if (entry->hash == hash && strcmp(entry->path, path) == 0)
+            return entry;
     }
+    return NULL;
+}
 
-    // verify offset alignment
-    if (conn->byte_offset % BLOCK_SIZE != 0)
+static void resp_cache_invalidate(const char *path)
+{
+    resp_cache_entry *entry = resp_cache_lookup(path, path_hash(path));
+    if (entry)
+        resp_unlink(entry);
+}
+
+// entry with room for header + body, NULL if path is already cached or the file is too big
+static resp_cache_entry *resp_cache_alloc(const char *path, uint32_t hash, off_t size, size_t header_len)
+{
+    if (size > RESP_CACHE_MAX_FILE || header_len + size > BUFFER_SIZE)
+        return NULL;
+    if (resp_cache_lookup(path, hash))
+        return NULL;
+
+    resp_cache_entry *entry = calloc(1, sizeof(resp_cache_entry));
+    if (!entry)
+        return NULL;
+    size_t head_room = align_to_block(header_len);
+    size_t body_room = align_to_block(size);
+    entry->charge = head_room + body_room + sizeof(resp_cache_entry);
+    entry->path = strdup(path);
+    if (!entry->path || posix_memalign((void **)&entry->base, MY_BLOCK_SIZE, head_room + body_room) != 0)
     {
-        fprintf(stderr, "Error: Offset %ld not aligned to block size %d\n",
-                conn->byte_offset, BLOCK_SIZE);
-        return CONN_ERROR;
+        free(entry->path);
+        free(entry);
+        return NULL;
     }
-    return 2;
+    entry->data = entry->base + head_room - header_len;
+    entry->hash = hash;
+    return entry;
 }
 
-int libaio_func(conn_state *conn, async_func_enum func, io_context_t *ctx_ptr, int *event_fd_ptr)
+// body is in place, prepend the header and make the entry visible
+static void resp_cache_link(resp_cache_entry *entry, off_t size, ino_t ino, struct timespec mtime,
+                            const char *header, size_t header_len)
 {
-    memset(&conn->aio_iocb, 0, sizeof(conn->aio_iocb));
-    switch (func)
-    {
-    case WRITE_FILE:
-        io_prep_pwrite(&conn->aio_iocb, conn->file_fd, conn->req_buffer, align_to_block(conn->bytes_read), conn->byte_offset);
-        break;
-    case READ_FILE:
+    uint32_t hash = entry->hash;
+    memcpy(entry->data, header, header_len);
+    entry->len = header_len + size;
+    entry->size = size;
+    entry->ino = ino;
+    entry->mtime = mtime;
+    entry->checked_at = coarse_now();
+
+    entry->bucket_next = resp_buckets[hash & (RESP_CACHE_BUCKETS - 1)];
+    resp_buckets[hash & (RESP_CACHE_BUCKETS - 1)] = entry;
+    resp_cache_bytes += entry->charge;
+    if (resp_ghost[hash & (RESP_CACHE_BUCKETS - 1)] == hash)
+        resp_queue_push(&resp_main, entry); // evicted from probation recently, it is hot after all
+    else
+        resp_queue_push(&resp_small, entry);
+    while (resp_cache_bytes > resp_cache_budget())
+        resp_evict_one();
+}
+
+// caches header + body of a small file, fd is only read from
+static void resp_cache_fill(const char *path, int fd, off_t size, ino_t ino, struct timespec mtime,
+                            const char *header, size_t header_len)
+{
+    resp_cache_entry *entry = resp_cache_alloc(path, path_hash(path), size, header_len);
+    if (!entry)
+        return;
+
+    // block sized reads so an O_DIRECT fd works too, the last one comes back short at EOF
+    char *body = entry->data + header_len;
+    off_t got = 0;
+    while (got < size)
+    {
+        ssize_t n = pread(fd, body + got, align_to_block(size) - got, got);
+        if (n <= 0)
+        {
+            if (n == -1 && errno == EINTR)
+                continue;
+            free(entry->base);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+        got += n;
+    }
+    resp_cache_link(entry, size, ino, mtime, header, header_len);
+}
+
+// same as resp_cache_fill() for a body that was already read, e.g. by a uring GET.
+// a cached copy of the same file version only gets its validation time refreshed, an older one is replaced
+static void resp_cache_insert(const char *path, const char *body, off_t size, ino_t ino, struct timespec mtime,
+                              const char *header, size_t header_len)
+{
+    uint32_t hash = path_hash(path);
+    resp_cache_entry *old = resp_cache_lookup(path, hash);
+    if (old)
+    {
+        if (old->ino == ino && old->size == size && old->mtime.tv_sec == mtime.tv_sec &&
+            old->mtime.tv_nsec == mtime.tv_nsec)
+        {
+            old->checked_at = coarse_now();
+            return;
+        }
+        resp_unlink(old);
+    }
+    resp_cache_entry *entry = resp_cache_alloc(path, hash, size, header_len);
+    if (!entry)
+        return;
+    memcpy(entry->data + header_len, body, size);
+    resp_cache_link(entry, size, ino, mtime, header, header_len);
+}
+
+// may_block as in fd_cache_get()
+static resp_cache_entry *resp_cache_get(const char *path, int may_block)
+{
+    resp_cache_entry *entry = resp_cache_lookup(path, path_hash(path));
+    if (!entry)
+    {
+        resp_cache_misses++;
+        return NULL;
+    }
+    time_t now = coarse_now();
+    if (now - entry->checked_at >= RESP_CACHE_TTL_S)
+    {
+        if (!may_block)
+        {
+            resp_cache_misses++;
+            return NULL;
+        }
+        if (file_changed(path, entry->ino, entry->size, entry->mtime))
+        {
+            resp_unlink(entry);
+            resp_cache_misses++;
+            return NULL;
+        }
+        entry->checked_at = now;
+    }
+    if (entry->freq < 3)
+        entry->freq++;
+    resp_cache_hits++;
+    return entry;
+}
+
+void resp_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+    *hits = resp_cache_hits;
+    *misses = resp_cache_misses;
+}
+
+static void get_full_path(const http_request *req, char *full_path, size_t size)
+{
+    // check if the path is just "/"
+    if (slice_eq(req->path, "/"))
+        snprintf(full_path, size, "%s/server-index.html", ROOT);
+    else
+        snprintf(full_path, size, "%s%.*s", ROOT, (int)req->path.len, req->path.ptr);
+}
+
+// user-space cache of O_DIRECT GET chunks keyed by (inode, mtime, offset), one BUFFER_SIZE chunk per slot.
+// per thread like the other caches, so a lookup never takes a lock or waits on another worker,
+// each thread gets its share of BLOCK_CACHE_BUDGET rounded down to a power of 2 slots
+typedef struct
+{
+    ino_t ino;
+    int64_t mtime_ns; // a rewritten file gets new keys, stale chunks just age out
+    off_t offset;
+    size_t len;
+    int next; // bucket chain, -1 terminated
+    int ref;  // CLOCK reference bit
+} block_slot;
+
+static __thread int block_slot_count = 0;   // power of 2
+static __thread int block_bucket_count = 0; // 2 * block_slot_count
+static __thread block_slot *block_slots = NULL;
+static __thread int *block_buckets = NULL;
+static __thread char *block_pool = NULL;
+static __thread int block_next_free = 0;
+static __thread int block_hand = 0;
+static __thread unsigned long block_cache_hits = 0;
+static __thread unsigned long block_cache_misses = 0;
+
+static int block_cache_init()
+{
+    if (block_slots)
+        return CONN_ALIVE;
+    size_t share = BLOCK_CACHE_BUDGET / cache_workers / BUFFER_SIZE;
+    block_slot_count = 1;
+    while ((size_t)block_slot_count * 2 <= share)
+        block_slot_count *= 2;
+    block_bucket_count = 2 * block_slot_count;
+    block_slots = calloc(block_slot_count, sizeof(block_slot));
+    block_buckets = malloc(block_bucket_count * sizeof(int));
+    // huge pages for the random lookups, but only backed once a chunk lands in them
+    if (!block_slots || !block_buckets ||
+        !(block_pool = io_pool_map((size_t)block_slot_count * BUFFER_SIZE, 0)))
+    {
+        free(block_slots);
+        free(block_buckets);
+        block_slots = NULL;
+        block_buckets = NULL;
+        return CONN_ERROR;
+    }
+    memset(block_buckets, -1, block_bucket_count * sizeof(int));
+    return CONN_ALIVE;
+}
+
+static unsigned block_bucket(ino_t ino, int64_t mtime_ns, off_t offset)
+{
+    uint64_t key = (uint64_t)ino * 0x9E3779B97F4A7C15ull ^ (uint64_t)mtime_ns ^ (uint64_t)(offset / BUFFER_SIZE) * 0xC2B2AE3D27D4EB4Full;
+    return (key ^ (key >> 29)) & (block_bucket_count - 1);
+}
+
+static int block_find(ino_t ino, int64_t mtime_ns, off_t offset)
+{
+    int i = block_buckets[block_bucket(ino, mtime_ns, offset)];
+    for (; i != -1; i = block_slots[i].next)
+    {
+        block_slot *slot = &block_slots[i];
+        if (slot->ino == ino && slot->offset == offset && slot->mtime_ns == mtime_ns)
+            return i;
+    }
+    return -1;
+}
+
+static int block_take_slot()
+{
+    if (block_next_free < block_slot_count)
+        return block_next_free++;
+    // CLOCK: skip chunks hit since the hand last passed
+    while (block_slots[block_hand].ref)
+    {
+        block_slots[block_hand].ref = 0;
+        block_hand = (block_hand + 1) % block_slot_count;
+    }
+    int victim = block_hand;
+    block_hand = (block_hand + 1) % block_slot_count;
+
+    block_slot *slot = &block_slots[victim];
+    int *link = &block_buckets[block_bucket(slot->ino, slot->mtime_ns, slot->offset)];
+    while (*link != victim)
+        link = &block_slots[*link].next;
+    *link = slot->next;
+    return victim;
+}
+
+// the chunk a GET conn reads next comes out of its file's (inode, mtime), 0 leaves it uncached
+void block_cache_bind(conn_state *conn)
+{
+    conn->file_ino = 0;
+    if (!USE_BLOCK_CACHE || conn->file_fd == -1)
+        return;
+    // buffered files already sit in the page cache
+    int direct_io = conn->file_entry ? conn->file_entry->direct_io : (fcntl(conn->file_fd, F_GETFL) & O_DIRECT) != 0;
+    if (!direct_io || block_cache_init() < 0)
+        return;
+    if (conn->file_entry)
+    {
+        conn->file_ino = conn->file_entry->ino;
+        conn->file_mtime_ns = conn->file_entry->mtime.tv_sec * 1000000000LL + conn->file_entry->mtime.tv_nsec;
+        return;
+    }
+    struct stat st;
+    if (fstat(conn->file_fd, &st) == -1)
+        return;
+    conn->file_ino = st.st_ino;
+    conn->file_mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+// copies the chunk at conn->byte_offset into dst, returns its length or 0 on a miss
+size_t block_cache_read(conn_state *conn, char *dst)
+{
+    if (!conn->file_ino)
+        return 0;
+    int i = block_find(conn->file_ino, conn->file_mtime_ns, conn->byte_offset);
+    if (i == -1)
+    {
+        block_cache_misses++;
+        return 0;
+    }
+    block_slots[i].ref = 1;
+    block_cache_hits++;
+    memcpy(dst, block_pool + (size_t)i * BUFFER_SIZE, block_slots[i].len);
+    return block_slots[i].len;
+}
+
+// keeps a chunk that was just read from disk, only whole chunks at chunk aligned offsets
+void block_cache_store(conn_state *conn, off_t offset, const char *src, size_t len)
+{
+    if (!conn->file_ino || offset < 0 || offset % BUFFER_SIZE != 0)
+        return;
+    off_t want = conn->file_size - offset;
+    if (want > BUFFER_SIZE)
+        want = BUFFER_SIZE;
+    if ((off_t)len != want || block_find(conn->file_ino, conn->file_mtime_ns, offset) != -1)
+        return;
+
+    int i = block_take_slot();
+    block_slot *slot = &block_slots[i];
+    slot->ino = conn->file_ino;
+    slot->mtime_ns = conn->file_mtime_ns;
+    slot->offset = offset;
+    slot->len = len;
+    slot->ref = 0;
+    memcpy(block_pool + (size_t)i * BUFFER_SIZE, src, len);
+    unsigned bucket = block_bucket(slot->ino, slot->mtime_ns, offset);
+    slot->next = block_buckets[bucket];
+    block_buckets[bucket] = i;
+}
+
+void block_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+    *hits = block_cache_hits;
+    *misses = block_cache_misses;
+}
+
+// per thread request counts by path hash, halved every IO_HEAT_DECAY GETs so old popularity fades
+static __thread uint8_t io_heat[IO_HEAT_SLOTS];
+static __thread unsigned io_heat_events = 0;
+
+static unsigned record_file_heat(const char *path)
+{
+    if (++io_heat_events >= IO_HEAT_DECAY)
+    {
+        for (int i = 0; i < IO_HEAT_SLOTS; i++)
+            io_heat[i] >>= 1;
+        io_heat_events = 0;
+    }
+    uint8_t *heat = &io_heat[path_hash(path) & (IO_HEAT_SLOTS - 1)];
+    if (*heat < UINT8_MAX)
+        (*heat)++;
+    return *heat;
+}
+
+// HTTP_IO_MODE=auto|buffered|direct overrides GET_IO_MODE without a rebuild
+static io_mode runtime_io_mode()
+{
+    static int mode = -1;
+    if (mode == -1)
+    {
+        const char *env = getenv("HTTP_IO_MODE");
+        if (env && strcmp(env, "buffered") == 0)
+            mode = IO_MODE_BUFFERED;
+        else if (env && strcmp(env, "direct") == 0)
+            mode = IO_MODE_DIRECT;
+        else if (env && strcmp(env, "auto") == 0)
+            mode = IO_MODE_AUTO;
+        else
+            mode = GET_IO_MODE;
+    }
+    return mode;
+}
+
+// small files and hot big ones live in the page cache, cold big streams bypass it
+static int want_direct_io(off_t size, unsigned heat)
+{
+    io_mode mode = runtime_io_mode();
+    if (mode != IO_MODE_AUTO)
+        return mode == IO_MODE_DIRECT;
+    return size >= DIRECT_IO_MIN_SIZE && heat < IO_HOT_HITS;
+}
+
+// switches an open fd to O_DIRECT or leaves it buffered with readahead hints, returns 1 if direct
+static int apply_io_policy(int fd, int open_flags, off_t size, unsigned heat)
+{
+    // O_DIRECT is a status flag, F_SETFL saves opening the file a second time
+    if (want_direct_io(size, heat) && fcntl(fd, F_SETFL, open_flags | O_DIRECT) == 0)
+        return 1;
+    if (size > BUFFER_SIZE)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (size >= DIRECT_IO_MIN_SIZE && heat < IO_HOT_HITS)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE); // buffered by override, don't let one stream flush the cache
+    return 0;
+}
+
+// libaio only queues O_DIRECT I/O, on a buffered fd io_submit() does the read or write inline and a
+// page cache miss stalls the whole epoll loop. so the event-driven server keeps every file direct
+static int libaio_direct_io(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags != -1 && ((flags & O_DIRECT) || fcntl(fd, F_SETFL, flags | O_DIRECT) == 0))
+        return 1;
+    perror("Failed to set O_DIRECT for libaio");
+    return 0;
+}
+
+int handle_get_header(int client_socket, const http_request *req, int *file_fd, file_cache_entry **entry,
+                      off_t *file_size, server_type s_type)
+{
+    char full_path[2048];
+    get_full_path(req, full_path, sizeof(full_path));
+    unsigned heat = record_file_heat(full_path);
+
+    if (USE_FD_CACHE && (*entry = fd_cache_get(full_path, 1)))
+    {
+        // no open, fstat or MIME lookup on a hit
+        *file_fd = (*entry)->fd;
+        *file_size = (*entry)->size;
+        if (USE_RESP_CACHE)
+            resp_cache_fill(full_path, *file_fd, *file_size, (*entry)->ino, (*entry)->mtime,
+                            (*entry)->header, (*entry)->header_len);
+        send(client_socket, (*entry)->header, (*entry)->header_len, *file_size > 0 ? MSG_MORE : 0);
+        return CONN_ALIVE;
+    }
+
+    // opened buffered, the io policy decides on O_DIRECT once the size is known
+    int open_flags = s_type == NON_BLOCKING ? O_RDONLY | O_NONBLOCK : O_RDONLY;
+    *file_fd = open(full_path, open_flags);
+
+    if (*file_fd == -1)
+    {
+        fprintf(stderr, "File not found: %s\n", strerror(errno));
+        send_static_response(client_socket, RESP_NOT_FOUND);
+        return CONN_CLOSED;
+    }
+
+    // get file size
+    struct stat st;
+    if (fstat(*file_fd, &st) == -1)
+    {
+        fprintf(stderr, "Couldnt get file size: %s\n", strerror(errno));
+        send_static_response(client_socket, RESP_FILE_SIZE_ERROR);
+        return CONN_ERROR;
+    }
+    *file_size = st.st_size;
+    // NON_BLOCKING is the libaio server here, the uring GET opens through its own path
+    int direct_io;
+    if (s_type == NON_BLOCKING)
+        direct_io = libaio_direct_io(*file_fd);
+    else
+        direct_io = apply_io_policy(*file_fd, open_flags, st.st_size, heat);
+
+    // get the MIME type
+    const char *mime_type = get_mime_type(full_path);
+    // printf("mime_type is: %s\n", mime_type);
+
+    // construct and send the HTTP header
+    char header[BUFFER_SIZE];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %ld\r\n\r\n",
+                              mime_type, *file_size);
+    if (USE_FD_CACHE)
+        *entry = fd_cache_put(full_path, *file_fd, &st, direct_io, mime_type, header, header_len);
+    if (USE_RESP_CACHE)
+        resp_cache_fill(full_path, *file_fd, *file_size, st.st_ino, st.st_mtim, header, header_len);
+    // MSG_MORE keeps the header queued until the first body send, both go out in one segment
+    send(client_socket, header, header_len, *file_size > 0 ? MSG_MORE : 0);
+    return CONN_ALIVE;
+}
+
+int handle_put_header(int client_socket, const http_request *req, int *file_fd,
+                      off_t *file_size, server_type s_type)
+{
+    char file_path[2048];
+
+    // Check if the path starts with "/upload"
+    if (req->path.len < 7 || strncmp(req->path.ptr, "/upload", 7) != 0)
+    {
+        fprintf(stderr, "Invalid upload path: %.*s\n", (int)req->path.len, req->path.ptr);
+        send_static_response(client_socket, RESP_BAD_UPLOAD_PATH);
+        return CONN_CLOSED;
+    }
+
+    // get content length
+    if (req->content_length.len == 0)
+    {
+        fprintf(stderr, "Content-Length header not found\n");
+        send_static_response(client_socket, RESP_LENGTH_REQUIRED);
+        return CONN_CLOSED;
+    }
+    *file_size = 0;
+    for (size_t i = 0; i < req->content_length.len; i++)
+    {
+        char c = req->content_length.ptr[i];
+        if (c < '0' || c > '9' || *file_size > (INT64_MAX - 9) / 10)
+        {
+            fprintf(stderr, "Bad Content-Length: %.*s\n", (int)req->content_length.len, req->content_length.ptr);
+            send_static_response(client_socket, RESP_BAD_CONTENT_LENGTH);
+            return CONN_CLOSED;
+        }
+        *file_size = *file_size * 10 + (c - '0');
+    }
+
+    // constructing file path under ROOT/uploads/
+    snprintf(file_path, sizeof(file_path), "%s/uploads%.*s", ROOT, (int)req->path.len - 7, req->path.ptr + 7);
+    if (USE_FD_CACHE)
+        fd_cache_invalidate(file_path);
+    if (USE_RESP_CACHE)
+        resp_cache_invalidate(file_path);
+    // printf("Trying to create file at: %s\n", file_path);
+
+    // open file for writing, an upload has no access history so only its size counts
+    int direct_flag = want_direct_io(*file_size, 0) ? O_DIRECT : 0;
+    if (s_type == NON_BLOCKING)
+        *file_fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC | direct_flag | O_NONBLOCK, 0644);
+    else
+        *file_fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC | direct_flag, 0644);
+    if (*file_fd == -1)
+    {
+        fprintf(stderr, "Error creating file: %s\n", strerror(errno));
+        return CONN_ERROR;
+    }
+
+    return CONN_ALIVE;
+}
+
+ssize_t send_fully(int fd, const void *buf, size_t to_send, server_type s_type)
+{
+    ssize_t sent = 0;
+    while (sent < to_send)
+    {
+        ssize_t n = send(fd, (char *)buf + sent, to_send - sent, 0);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue; // Retry
+            }
+            // for eagain and ewouldblock
+            if (s_type == NON_BLOCKING && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return sent;
+            perror("Couldnt send: \n");
+            return -1; // Real error
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+ssize_t write_fully(int fd, const void *buf, size_t to_write, server_type s_type)
+{
+    ssize_t written = 0;
+    to_write = align_to_block(to_write);
+    while (written < to_write)
+    {
+        ssize_t n = write(fd, (char *)buf + written, to_write - written);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue; // Retry
+            }
+            // for eagain and ewouldblock
+            if (s_type == NON_BLOCKING && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return written;
+            perror("Couldnt write: \n");
+            return -1; // Real error
+        }
+        written += n;
+    }
+    return written;
+}
+
+// whole GET response from the cache in one send. a nonblocking send that comes up short copies
+// the rest into spill (BUFFER_SIZE) for the caller to finish, blocking callers pass NULL.
+// may_block 0 never stat()s, an entry due for revalidation is a miss
+int send_cached_response(int client_socket, const http_request *req, char *spill, size_t *spill_len,
+                         server_type s_type, int may_block)
+{
+    if (!USE_RESP_CACHE)
+        return CACHE_MISS;
+    char full_path[2048];
+    get_full_path(req, full_path, sizeof(full_path));
+    resp_cache_entry *entry = resp_cache_get(full_path, may_block);
+    if (!entry)
+        return CACHE_MISS;
+
+    ssize_t sent = send_fully(client_socket, entry->data, entry->len, s_type);
+    if (sent == -1)
+        return CONN_ERROR;
+    if (spill_len)
+    {
+        *spill_len = entry->len - sent;
+        memcpy(spill, entry->data + sent, *spill_len);
+    }
+    return CONN_ALIVE;
+}
+
+// bytes in req_buffer past request_end belong to pipelined requests, keep them for after this one
+int stash_pipelined(conn_state *conn, size_t request_end)
+{
+    if (conn->bytes_read <= request_end)
+        return CONN_ALIVE;
+    conn->carry_len = conn->bytes_read - request_end;
+    conn->carry = malloc(conn->carry_len);
+    if (!conn->carry)
+    {
+        perror("Failed to stash pipelined request");
+        conn->carry_len = 0;
+        return CONN_ERROR;
+    }
+    memcpy(conn->carry, conn->req_buffer + request_end, conn->carry_len);
+    conn->bytes_read = request_end;
+    return CONN_ALIVE;
+}
+
+// ready a keep-alive conn for its next request, stashed pipelined bytes go back into req_buffer
+void reset_conn(conn_state *conn)
+{
+    release_conn_file(conn);
+    put_file(&conn->file_fd, &conn->file_entry);
+    conn->file_ino = 0;
+    conn->file_direct = 0;
+    conn->file_size = 0;
+    conn->byte_offset = 0;
+    conn->util_offset = 0;
+    conn->pipe_pending = 0;
+    conn->header_len = 0;
+    conn->header_sent = 0;
+    conn->header_deadline_set = 0;
+    free(conn->open_req);
+    conn->open_req = NULL;
+    conn->state = READING_HEADER;
+    conn->last_op = OP_READ;
+    memset(&conn->parser, 0, sizeof(conn->parser));
+
+    // an idle conn doesn't need to hold a provided buffer, or a pool one borrowed while the ring was dry
+    if (conn->buf_id != -1 && conn->carry_len == 0)
+        recycle_provided_buf(conn);
+    else if (conn->req_buffer && conn->carry_len == 0 && buf_ring_enabled())
+    {
+        io_buffer_put(conn->req_buffer);
+        conn->req_buffer = NULL;
+    }
+    conn->bytes_read = 0;
+    if (!conn->req_buffer)
+        return;
+    if (conn->carry_len > 0)
+        memcpy(conn->req_buffer, conn->carry, conn->carry_len);
+    conn->bytes_read = conn->carry_len;
+    free(conn->carry);
+    conn->carry = NULL;
+    conn->carry_len = 0;
+}
+
+// huge page backed BUFFER_SIZE io buffers shared by every thread of the process. buffers are never
+// zeroed, reads and recvs overwrite them and everything downstream goes by byte counts
+static pthread_mutex_t io_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *io_pool_free = NULL; // free list, a free buffer keeps the next pointer in its first bytes
+static size_t io_pool_total = 0;
+static const char *io_pool_backing = "no";
+
+static size_t huge_page_align(size_t bytes)
+{
+    return (bytes + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+}
+
+// explicit huge pages when some are reserved (vm.nr_hugepages), else THP advised memory starting on a
+// huge page boundary. prefault takes every page fault now instead of on the first requests
+void *io_pool_map(size_t bytes, int prefault)
+{
+    size_t len = huge_page_align(bytes);
+    char *mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (prefault ? MAP_POPULATE : 0), -1, 0);
+    if (mem != MAP_FAILED)
+        io_pool_backing = "hugetlb";
+    else
+    {
+        // over-map by one huge page and trim, THP only backs aligned 2mb ranges
+        char *raw = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED)
+        {
+            perror("Failed to map io buffers");
+            return NULL;
+        }
+        mem = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+        if (mem > raw)
+            munmap(raw, mem - raw);
+        munmap(mem + len, raw + HUGE_PAGE_SIZE - mem);
+        io_pool_backing = madvise(mem, len, MADV_HUGEPAGE) == 0 ? "THP" : "4kb";
+        if (prefault)
+        {
+            for (size_t off = 0; off < len; off += MY_BLOCK_SIZE)
+                ((volatile char *)mem)[off] = 0;
+        }
+    }
+    if (USE_MLOCK_POOL && prefault && mlock(mem, len) == -1)
+        perror("Failed to lock io buffers");
+    return mem;
+}
+
+void io_pool_unmap(void *mem, size_t bytes)
+{
+    munmap(mem, huge_page_align(bytes));
+}
+
+// caller holds io_pool_lock
+static int io_pool_grow(size_t count)
+{
+    size_t bytes = huge_page_align(count * BUFFER_SIZE);
+    char *mem = io_pool_map(bytes, 1);
+    if (!mem)
+        return CONN_ERROR;
+    for (size_t i = bytes / BUFFER_SIZE; i-- > 0;)
+    {
+        char *buf = mem + i * BUFFER_SIZE;
+        *(char **)buf = io_pool_free;
+        io_pool_free = buf;
+    }
+    io_pool_total += bytes / BUFFER_SIZE;
+    return CONN_ALIVE;
+}
+
+// startup reserve, call before any worker thread exists and never in a parent that forks workers
+int io_pool_init(size_t count)
+{
+    pthread_mutex_lock(&io_pool_lock);
+    int ret = io_pool_grow(count);
+    pthread_mutex_unlock(&io_pool_lock);
+    if (ret == CONN_ALIVE)
+        printf("IO buffer pool: %zu buffers on %s pages%s\n", io_pool_total, io_pool_backing,
+               USE_MLOCK_POOL ? ", locked" : "");
+    return ret;
+}
+
+// BUFFER_SIZE, MY_BLOCK_SIZE aligned, contents undefined
+char *io_buffer_get()
+{
+    pthread_mutex_lock(&io_pool_lock);
+    if (!io_pool_free && io_pool_grow(HUGE_PAGE_SIZE / BUFFER_SIZE) < 0)
+    {
+        pthread_mutex_unlock(&io_pool_lock);
+        return NULL;
+    }
+    char *buf = io_pool_free;
+    io_pool_free = *(char **)buf;
+    pthread_mutex_unlock(&io_pool_lock);
+    return buf;
+}
+
+void io_buffer_put(char *buf)
+{
+    pthread_mutex_lock(&io_pool_lock);
+    *(char **)buf = io_pool_free;
+    io_pool_free = buf;
+    pthread_mutex_unlock(&io_pool_lock);
+}
+
+// per thread slab of conns. slots come off a free list and are never handed back to malloc, the
+// mapping is only backed as slots get used, and io_uring user_data / aio data / epoll data carry
+// a generation tagged handle so a completion for a closed conn can't reach the slot's next owner
+static __thread conn_state *conn_table = NULL;
+static __thread int conn_table_slots = 0;
+static __thread int conn_table_used = 0; // slots handed out at least once
+static __thread int conn_free_head = -1;
+
+// own_buffer borrows req_buffer from the io buffer pool, without it req_buffer starts NULL
+conn_state *conn_alloc(int own_buffer)
+{
+    if (!conn_table)
+    {
+        // a thread can't hold more conns than the process has fds, so the fd limit is the table size
+        long slots = CONN_TABLE_SLOTS;
+        struct rlimit nofile;
+        if (slots <= 0 && getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur != RLIM_INFINITY)
+            slots = nofile.rlim_cur;
+        if (slots <= 0 || slots > CONN_TABLE_MAX_SLOTS)
+            slots = CONN_TABLE_MAX_SLOTS;
+        void *table = mmap(NULL, (size_t)slots * sizeof(conn_state), PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (table == MAP_FAILED)
+        {
+            perror("Failed to map connection table");
+            return NULL;
+        }
+        conn_table = table;
+        conn_table_slots = slots;
+    }
+    char *buffer = NULL;
+    if (own_buffer && !(buffer = io_buffer_get()))
+        return NULL;
+
+    int index;
+    if (conn_free_head != -1)
+    {
+        index = conn_free_head;
+        conn_free_head = conn_table[index].next_free;
+    }
+    else if (conn_table_used < conn_table_slots)
+        index = conn_table_used++;
+    else
+    {
+        fprintf(stderr, "Connection table full (%d slots), raise RLIMIT_NOFILE\n", conn_table_slots);
+        if (buffer)
+            io_buffer_put(buffer);
+        return NULL;
+    }
+
+    conn_state *conn = &conn_table[index];
+    // hot and warm lines plus the parser, the rest of the cold part is written before use
+    memset(conn, 0, offsetof(conn_state, parser));
+    memset(&conn->parser, 0, sizeof(conn->parser));
+    if (conn->gen == 0)
+        conn->gen = 1; // first use of the slot, 0 is reserved for non-conn handles
+    conn->index = index;
+    conn->req_buffer = buffer;
+    conn->fd = -1;
+    conn->file_fd = -1;
+    conn->file_slot = -1;
+    conn->buf_id = -1;
+    conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+    conn->timer_slot = -1;
+    conn->state = READING_HEADER;
+    conn->last_op = OP_READ;
+    return conn;
+}
+
+// slot goes back on the free list and a pool req_buffer back to the pool, a provided buffer
+// must already be recycled. fds are the caller's
+void conn_free(conn_state *conn)
+{
+    timer_wheel_cancel(conn);
+    if (conn->req_buffer && conn->buf_id == -1)
+        io_buffer_put(conn->req_buffer);
+    conn->req_buffer = NULL;
+    if (++conn->gen == 0)
+        conn->gen = 1;
+    conn->next_free = conn_free_head;
+    conn_free_head = conn->index;
+}
+
+// gen << 32 | index << 1, bit 0 is left for LINKED_READ_TAG
+uint64_t conn_handle(const conn_state *conn)
+{
+    return (uint64_t)conn->gen << 32 | (uint64_t)conn->index << 1;
+}
+
+// NULL for handles of closed conns and for the non-conn ones (generation 0)
+conn_state *conn_lookup(uint64_t handle)
+{
+    uint32_t gen = handle >> 32;
+    uint32_t index = (uint32_t)handle >> 1;
+    if (gen == 0 || !conn_table || index >= (uint32_t)conn_table_used)
+        return NULL;
+    conn_state *conn = &conn_table[index];
+    return conn->gen == gen ? conn : NULL;
+}
+
+// deadline of whatever the conn waits on next: the keep-alive idle limit between requests, one
+// header limit for the whole header (a trickling client doesn't get it renewed) and a fresh
+// progress limit for every body recv or send
+void conn_touch_deadline(conn_state *conn)
+{
+    time_t secs;
+    if (conn->state != READING_HEADER)
+        secs = BODY_TIMEOUT_S;
+    else if (conn->header_deadline_set)
+        return;
+    else if (conn->bytes_read == 0 && conn->keep_alive)
+        secs = KEEP_ALIVE_TIMEOUT_S;
+    else
+    {
+        conn->header_deadline_set = 1;
+        secs = HEADER_TIMEOUT_S;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    conn->deadline.tv_sec = now.tv_sec + secs;
+    conn->deadline.tv_nsec = now.tv_nsec;
+}
+
+// two level timer wheel of the thread's conns, linked through their table indices. level 0 lists
+// hold conns due within TIMER_WHEEL_SLOTS ticks, a level 1 list holds TIMER_WHEEL_SLOTS ticks worth
+// and is cascaded into level 0 when its turn comes, so schedule, cancel and expiry are O(1) a conn
+#define TIMER_EXPIRED_LIST (2 * TIMER_WHEEL_SLOTS)
+static __thread int timer_heads[TIMER_EXPIRED_LIST + 1];
+static __thread uint64_t timer_now; // current tick, 0 until the wheel is first used
+
+static uint64_t timer_tick_of(time_t sec, long nsec)
+{
+    return ((uint64_t)sec * 1000 + nsec / 1000000 + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+}
+
+static void timer_wheel_init()
+{
+    if (timer_now)
+        return;
+    for (int i = 0; i <= TIMER_EXPIRED_LIST; i++)
+        timer_heads[i] = -1;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    timer_now = timer_tick_of(now.tv_sec, now.tv_nsec);
+}
+
+static void timer_link(conn_state *conn, int list)
+{
+    conn->timer_slot = list;
+    conn->timer_prev = -1;
+    conn->timer_next = timer_heads[list];
+    if (conn->timer_next != -1)
+        conn_table[conn->timer_next].timer_prev = conn->index;
+    timer_heads[list] = conn->index;
+}
+
+void timer_wheel_cancel(conn_state *conn)
+{
+    if (conn->timer_slot == -1)
+        return;
+    if (conn->timer_prev != -1)
+        conn_table[conn->timer_prev].timer_next = conn->timer_next;
+    else
+        timer_heads[conn->timer_slot] = conn->timer_next;
+    if (conn->timer_next != -1)
+        conn_table[conn->timer_next].timer_prev = conn->timer_prev;
+    conn->timer_slot = -1;
+}
+
+static void timer_place(conn_state *conn)
+{
+    const uint64_t mask = TIMER_WHEEL_SLOTS - 1;
+    if (conn->timer_expire <= timer_now)
+        timer_link(conn, TIMER_EXPIRED_LIST);
+    else if (conn->timer_expire - timer_now < TIMER_WHEEL_SLOTS)
+        timer_link(conn, conn->timer_expire & mask);
+    else
+    {
+        // level 1 only reaches TIMER_WHEEL_SLOTS - 1 blocks ahead of the current one
+        uint64_t last = (timer_now / TIMER_WHEEL_SLOTS + TIMER_WHEEL_SLOTS) * TIMER_WHEEL_SLOTS - 1;
+        if (conn->timer_expire > last)
+            conn->timer_expire = last;
+        timer_link(conn, TIMER_WHEEL_SLOTS + ((conn->timer_expire / TIMER_WHEEL_SLOTS) & mask));
+    }
+}
+
+// (re)arm the conn for its current state, see conn_touch_deadline()
+void timer_wheel_schedule(conn_state *conn)
+{
+    timer_wheel_init();
+    conn_touch_deadline(conn);
+    timer_wheel_cancel(conn);
+    conn->timer_expire = timer_tick_of(conn->deadline.tv_sec, conn->deadline.tv_nsec);
+    timer_place(conn);
+}
+
+// moves every list that came due onto the expired list
+static void timer_wheel_advance()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    uint64_t target = timer_tick_of(now.tv_sec, now.tv_nsec);
+    while (timer_now < target)
+    {
+        timer_now++;
+        int list = timer_now & (TIMER_WHEEL_SLOTS - 1);
+        if (list == 0)
+        {
+            int cascade = TIMER_WHEEL_SLOTS + ((timer_now / TIMER_WHEEL_SLOTS) & (TIMER_WHEEL_SLOTS - 1));
+            int index;
+            while ((index = timer_heads[cascade]) != -1)
+            {
+                timer_wheel_cancel(&conn_table[index]);
+                timer_place(&conn_table[index]);
+            }
+        }
+        int index = timer_heads[list];
+        while (index != -1)
+        {
+            conn_state *conn = &conn_table[index];
+            index = conn->timer_next;
+            if (conn->timer_expire <= timer_now)
+            {
+                timer_wheel_cancel(conn);
+                timer_link(conn, TIMER_EXPIRED_LIST);
+            }
+        }
+    }
+}
+
+// next conn past its deadline, unscheduled, NULL once there are none. call until NULL every tick
+conn_state *timer_wheel_expire()
+{
+    timer_wheel_init();
+    if (timer_heads[TIMER_EXPIRED_LIST] == -1)
+        timer_wheel_advance();
+    int index = timer_heads[TIMER_EXPIRED_LIST];
+    if (index == -1)
+        return NULL;
+    timer_wheel_cancel(&conn_table[index]);
+    return &conn_table[index];
+}
+
+// GET body of a blocking request, CONN_ALIVE once the whole file is out
+static int blocking_get_body(int client_socket, int *file_fd, off_t file_size, char *req_buffer)
+{
+    off_t byte_offset = 0;
+    if (USE_SENDFILE_GET)
+    {
+        // sendfile advances byte_offset itself, loop over partial transfers
+        while (byte_offset < file_size)
+        {
+            ssize_t sent = sendfile(client_socket, *file_fd, &byte_offset, file_size - byte_offset);
+            if (sent == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                // fs can't sendfile this file, fall back to the pread path
+                if ((errno == EINVAL || errno == ENOSYS) && byte_offset == 0)
+                    break;
+                perror("SENDFILE FAILED in GET ");
+                return CONN_ERROR;
+            }
+            if (sent == 0)
+            {
+                fprintf(stderr, "File shrank during sendfile at offset %ld\n", byte_offset);
+                return CONN_ERROR;
+            }
+        }
+        if (byte_offset >= file_size)
+            return CONN_ALIVE;
+    }
+
+    // use the req_buffer as send buffer, pread overwrites what gets sent so no zeroing
+    while (byte_offset < file_size)
+    {
+        ssize_t bytes_read = pread(*file_fd, req_buffer, BUFFER_SIZE, byte_offset);
+        if (bytes_read == -1)
+        {
+            perror("PREAD FAILED in GET ");
+            return CONN_ERROR;
+        }
+
+        ssize_t sent = send_fully(client_socket, req_buffer, bytes_read, BLOCKING);
+        if (sent == -1)
+        {
+            perror("Error sending blocking data");
+            return CONN_ERROR;
+        }
+        // printf("bytes_read=%zd, sent=%zd, file_size=%zd \n", bytes_read, sent, file_size);
+        byte_offset += sent;
+    }
+    return CONN_ALIVE;
+}
+
+// PUT body of a blocking request, body_len bytes of it already sit at the front of req_buffer
+// SO_RCVTIMEO restarts on every recv, so a trickling client would never run out of time. the
+// blocking loops keep an absolute deadline instead and hand each recv only what is left of it
+static void set_recv_deadline(struct timespec *deadline, time_t secs)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += secs;
+}
+
+// CONN_CLOSED once the deadline has passed, the caller answers 408
+static int arm_recv_deadline(int client_socket, const struct timespec *deadline)
+{
+    if (!USE_CONN_TIMEOUTS)
+        return CONN_ALIVE;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long left_us = (deadline->tv_sec - now.tv_sec) * 1000000L + (deadline->tv_nsec - now.tv_nsec) / 1000;
+    if (left_us <= 0)
+        return CONN_CLOSED;
+    struct timeval left = {.tv_sec = left_us / 1000000, .tv_usec = left_us % 1000000};
+    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &left, sizeof(left));
+    return CONN_ALIVE;
+}
+
+static int blocking_put_body(int client_socket, int *file_fd, off_t file_size, char *req_buffer, size_t body_len)
+{
+    off_t byte_offset = 0;
+    if (body_len > 0)
+    {
+        if (body_len >= file_size)
+        {
+            ssize_t written = write_fully(*file_fd, req_buffer, BUFFER_SIZE, BLOCKING);
+            if (written == -1)
+                return CONN_ERROR;
+            byte_offset += written;
+
+            if (byte_offset >= file_size)
+            {
+                send_static_response(client_socket, RESP_CREATED);
+                return CONN_ALIVE;
+            }
+            return CONN_ERROR;
+        }
+        else
+        {
+            // set rest values as 0
+            memset(req_buffer + body_len, 0, BUFFER_SIZE - body_len);
+        }
+    }
+    size_t bytes_read = body_len;
+    // the whole body has BODY_TIMEOUT_S, however it trickles in
+    struct timespec deadline;
+    set_recv_deadline(&deadline, BODY_TIMEOUT_S);
+    // printf("bytes_read=%zd, byte_offset=%zd, file_size=%zd \n", bytes_read, byte_offset, file_size);
+    while (byte_offset < file_size)
+    {
+        // never read past the body, the next pipelined request stays in the socket
+        size_t to_recv = BUFFER_SIZE - bytes_read;
+        if (file_size - byte_offset - bytes_read < to_recv)
+            to_recv = file_size - byte_offset - bytes_read;
+        ssize_t bytes_recvd = -1;
+        errno = EAGAIN;
+        if (arm_recv_deadline(client_socket, &deadline) == CONN_ALIVE)
+            bytes_recvd = recv(client_socket, req_buffer + bytes_read, to_recv, 0);
+        if (bytes_recvd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            send_static_response(client_socket, RESP_REQUEST_TIMEOUT);
+            return CONN_CLOSED;
+        }
+        if (bytes_recvd < 0)
+        {
+            perror("Client stopped sending");
+            send_static_response(client_socket, RESP_MALFORMED);
+            return CONN_CLOSED;
+        }
+        if (bytes_recvd == 0)
+        {
+            perror("Client disconnected");
+            send_static_response(client_socket, RESP_CLIENT_DISCONNECTED);
+            return CONN_CLOSED;
+        }
+        bytes_read += bytes_recvd;
+        if (bytes_read < BUFFER_SIZE)
+        {
+            memset(req_buffer + bytes_read, 0, BUFFER_SIZE - bytes_read);
+            if (byte_offset + bytes_read < file_size)
+            {
+                continue;
+            }
+        }
+
+        ssize_t written = write_fully(*file_fd, req_buffer, BUFFER_SIZE, BLOCKING);
+        if (written == -1)
+            return CONN_ERROR;
+        byte_offset += written;
+        // printf("bytes_recvd=%zd, bytes_read=%zd, byte_offset=%zd, file_size=%zd \n", bytes_recvd, bytes_read, byte_offset, file_size);
+        bytes_read = 0;
+    }
+    if (byte_offset >= file_size)
+    {
+        send_static_response(client_socket, RESP_CREATED);
+        return CONN_ALIVE;
+    }
+    return CONN_ERROR;
+}
+
+// serves requests on client_socket until the client closes or asks to, pipelined requests in order
+static int serve_blocking_requests(int client_socket, int *file_fd, file_cache_entry **entry, char *req_buffer)
+{
+    off_t file_size;
+    ssize_t n;
+    size_t buffered = 0; // bytes of the current and any pipelined requests in req_buffer
+    char *carry = NULL;
+    size_t carry_len = 0;
+    int served = 0;
+    http_parser parser;
+    parse_status status;
+
+    struct timespec deadline;
+
+    if (USE_CONN_TIMEOUTS)
+    {
+        // a stalled send fails with EAGAIN and drops the conn, recvs go by the deadline below
+        struct timeval body_timeout = {.tv_sec = BODY_TIMEOUT_S, .tv_usec = 0};
+        setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &body_timeout, sizeof(body_timeout));
+    }
+
+    while (1)
+    {
+        // read until we have the full header. an idle keep-alive conn gets KEEP_ALIVE_TIMEOUT_S,
+        // the header gets HEADER_TIMEOUT_S in total from its first byte
+        int header_started = served == 0 || buffered > 0;
+        set_recv_deadline(&deadline, header_started ? HEADER_TIMEOUT_S : KEEP_ALIVE_TIMEOUT_S);
+        memset(&parser, 0, sizeof(parser));
+        while ((status = parse_request(&parser, req_buffer, buffered)) != PARSE_DONE)
+        {
+            if (status == PARSE_BAD)
+            {
+                send_static_response(client_socket, RESP_MALFORMED);
+                return CONN_CLOSED;
+            }
+            if (buffered >= BUFFER_SIZE)
+            {
+                send_static_response(client_socket, RESP_HEADER_TOO_LARGE);
+                return CONN_CLOSED;
+            }
+            n = -1;
+            errno = EAGAIN; // past the deadline, same as a recv that timed out
+            if (arm_recv_deadline(client_socket, &deadline) == CONN_ALIVE)
+                n = recv(client_socket, req_buffer + buffered, BUFFER_SIZE - buffered, 0);
+            if (served > 0 && buffered == 0 && (n == 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))))
+                return CONN_CLOSED; // idle keep-alive conn closed or timed out
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                send_static_response(client_socket, RESP_REQUEST_TIMEOUT);
+                return CONN_CLOSED;
+            }
+            if (n < 0)
+            {
+                perror("Client sent nothing");
+                send_static_response(client_socket, RESP_MALFORMED);
+                return CONN_CLOSED;
+            }
+            if (n == 0)
+            {
+                perror("Client disconnected");
+                send_static_response(client_socket, RESP_CLIENT_DISCONNECTED);
+                return CONN_CLOSED;
+            }
+            buffered += n;
+            if (!header_started)
+            {
+                header_started = 1;
+                set_recv_deadline(&deadline, HEADER_TIMEOUT_S);
+            }
+        }
+        const http_request *req = &parser.req;
+        size_t header_len = req->header_len;
+        int keep_alive = wants_keep_alive(req);
+        // printf("Received request:\n%.*s %.*s\n", (int)req->method.len, req->method.ptr, (int)req->path.len, req->path.ptr);
+
+        int res;
+        // Handle GET method
+        if (slice_eq(req->method, "GET"))
+        {
+            // everything behind the header belongs to pipelined requests
+            carry_len = buffered - header_len;
+            if (carry_len > 0)
+            {
+                if (!(carry = malloc(carry_len)))
+                    return CONN_ERROR;
+                memcpy(carry, req_buffer + header_len, carry_len);
+            }
+            res = send_cached_response(client_socket, req, NULL, NULL, BLOCKING, 1);
+            if (res == CACHE_MISS)
+            {
+                res = handle_get_header(client_socket, req, file_fd, entry, &file_size, BLOCKING);
+                if (res == CONN_ALIVE)
+                    res = blocking_get_body(client_socket, file_fd, file_size, req_buffer);
+            }
+        }
+        // Handle PUT method
+        else if (slice_eq(req->method, "PUT"))
+        {
+            res = handle_put_header(client_socket, req, file_fd, &file_size, BLOCKING);
+            if (res == CONN_ALIVE)
+            {
+                size_t body_len = buffered - header_len;
+                if (body_len > file_size)
+                {
+                    // bytes past the body belong to pipelined requests
+                    carry_len = body_len - file_size;
+                    if (!(carry = malloc(carry_len)))
+                        return CONN_ERROR;
+                    memcpy(carry, req_buffer + header_len + file_size, carry_len);
+                    body_len = file_size;
+                }
+                // move the content to the start
+                memmove(req_buffer, req_buffer + header_len, body_len);
+                res = blocking_put_body(client_socket, file_fd, file_size, req_buffer, body_len);
+            }
+        }
+        else
+        {
+            // Unsupported method
+            send_static_response(client_socket, RESP_METHOD_NOT_ALLOWED);
+            return CONN_CLOSED;
+        }
+
+        if (res == CONN_ERROR)
+            perror("error completing request");
+        if (res != CONN_ALIVE || !keep_alive)
+        {
+            free(carry);
+            return res == CONN_ALIVE ? CONN_CLOSED : res;
+        }
+
+        // next request on the same conn, pipelined bytes first
+        put_file(file_fd, entry);
+        if (carry_len > 0)
+            memcpy(req_buffer, carry, carry_len);
+        buffered = carry_len;
+        free(carry);
+        carry = NULL;
+        carry_len = 0;
+        served++;
+    }
+}
+
+int handle_blocking_requests(int client_socket, int *file_fd, char *req_buffer)
+{
+    file_cache_entry *entry = NULL;
+    int res = serve_blocking_requests(client_socket, file_fd, &entry, req_buffer);
+    // a cached fd is shared, the caller only ever closes a private one
+    if (entry)
+        put_file(file_fd, &entry);
+    return res;
+}
+
+int verify_alignment(conn_state *conn)
+{
+    // Verify buffer alignment
+    if ((uintptr_t)conn->req_buffer % MY_BLOCK_SIZE != 0)
+    {
+        perror("Error: Buffer not aligned to block size ");
+        return CONN_ERROR;
+    }
+
+    // verify offset alignment
+    if (conn->byte_offset % MY_BLOCK_SIZE != 0)
+    {
+        fprintf(stderr, "Error: Offset %ld not aligned to block size %d\n",
+                conn->byte_offset, MY_BLOCK_SIZE);
+        return CONN_ERROR;
+    }
+    return 2;
+}
+
+int libaio_func(conn_state *conn, async_func_enum func, io_context_t *ctx_ptr, int *event_fd_ptr)
+{
+    memset(&conn->aio_iocb, 0, sizeof(conn->aio_iocb));
+    switch (func)
+    {
+    case WRITE_FILE:
+        io_prep_pwrite(&conn->aio_iocb, conn->file_fd, conn->req_buffer, align_to_block(conn->bytes_read), conn->byte_offset);
+        break;
+    case READ_FILE:
         io_prep_pread(&conn->aio_iocb, conn->file_fd, conn->req_buffer, BUFFER_SIZE, conn->byte_offset);
         break;
     default:
@@ -398,286 +1836,1092 @@ int libaio_func(conn_state *conn, async_func_enum func, io_context_t *ctx_ptr, i
         return CONN_ERROR;
     }
 
-    io_set_eventfd(&conn->aio_iocb, *event_fd_ptr);
-    conn->aio_iocb.data = conn;
+    io_set_eventfd(&conn->aio_iocb, *event_fd_ptr);
+    conn->aio_iocb.data = (void *)(uintptr_t)conn_handle(conn);
+
+    // precautionary
+    if (get_req_counter() >= BATCH_SIZE)
+    {
+        submit_iocbs(*ctx_ptr);
+    }
+
+    add_to_iocbs(&conn->aio_iocb);
+    return CONN_ALIVE;
+}
+
+// next GET chunk, straight from the block cache when it has it, else an aio read
+static int read_chunk_event_driven(conn_state *conn, io_context_t *ctx_ptr, int *event_fd_ptr)
+{
+    size_t cached = block_cache_read(conn, conn->req_buffer);
+    if (cached > 0)
+    {
+        // same result as a completed WAITING_FOR_AIO_READ, the send waits for EPOLLOUT
+        conn->last_aio_res = cached;
+        conn->byte_offset += cached;
+        conn->util_offset = 0;
+        conn->state = HANDLING_POST_IO;
+        return CONN_ALIVE;
+    }
+    conn->state = WAITING_FOR_AIO_READ;
+    return libaio_func(conn, READ_FILE, ctx_ptr, event_fd_ptr);
+}
+
+// response fully sent, either close or start on the next request of a keep-alive conn
+static int finish_request_event_driven(io_context_t *global_aio_ctx, int *global_aio_event_fd, conn_state *conn)
+{
+    if (!conn->keep_alive)
+        return CONN_CLOSED;
+    reset_conn(conn);
+    return handle_requests_event_driven(global_aio_ctx, global_aio_event_fd, conn);
+}
+
+int handle_requests_event_driven(io_context_t *global_aio_ctx, int *global_aio_event_fd, conn_state *conn)
+{
+    ssize_t n;
+
+    if (conn->state == READING_HEADER)
+    {
+        n = recv(conn->fd, conn->req_buffer + conn->bytes_read, BUFFER_SIZE - conn->bytes_read, 0);
+
+        if (n < 0)
+        {
+            // a pipelined request may already sit in the buffer
+            if ((errno != EAGAIN && errno != EWOULDBLOCK) || conn->bytes_read == 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return CONN_ALIVE;
+                perror("Client stopped sending");
+                send_static_response(conn->fd, RESP_MALFORMED);
+                return CONN_CLOSED;
+            }
+            n = 0;
+        }
+        else if (n == 0)
+        {
+            if (conn->bytes_read == 0 && conn->keep_alive)
+                return CONN_CLOSED; // idle keep-alive conn closed by the client
+            perror("Client disconnected");
+            send_static_response(conn->fd, RESP_CLIENT_DISCONNECTED);
+            return CONN_CLOSED;
+        }
+        conn->bytes_read += n;
+
+        // if we have full header request
+        parse_status status = parse_request(&conn->parser, conn->req_buffer, conn->bytes_read);
+        if (status == PARSE_BAD)
+        {
+            send_static_response(conn->fd, RESP_MALFORMED);
+            return CONN_CLOSED;
+        }
+        if (status == PARSE_INCOMPLETE && conn->bytes_read >= BUFFER_SIZE)
+        {
+            send_static_response(conn->fd, RESP_HEADER_TOO_LARGE);
+            return CONN_CLOSED;
+        }
+        if (status == PARSE_DONE)
+        {
+            const http_request *req = &conn->parser.req;
+            size_t header_len = req->header_len;
+            conn->keep_alive = wants_keep_alive(req);
+            // printf("Received request:\n%.*s %.*s\n", (int)req->method.len, req->method.ptr, (int)req->path.len, req->path.ptr);
+
+            // Handle GET method
+            if (slice_eq(req->method, "GET"))
+            {
+                if (stash_pipelined(conn, header_len) == CONN_ERROR)
+                    return CONN_ERROR;
+                size_t spill_len;
+                int res = send_cached_response(conn->fd, req, conn->req_buffer, &spill_len, NON_BLOCKING, 1);
+                if (res == CONN_ERROR)
+                    return CONN_ERROR;
+                if (res == CONN_ALIVE)
+                {
+                    if (spill_len == 0)
+                        return finish_request_event_driven(global_aio_ctx, global_aio_event_fd, conn);
+                    // socket buffer full, send the rest from req_buffer on EPOLLOUT
+                    conn->last_aio_res = spill_len;
+                    conn->util_offset = 0;
+                    conn->byte_offset = conn->file_size = 0;
+                    conn->state = HANDLING_POST_IO;
+                    return CONN_ALIVE;
+                }
+                res = handle_get_header(conn->fd, req, &conn->file_fd, &conn->file_entry,
+                                        &conn->file_size, NON_BLOCKING);
+                if (res == CONN_ERROR)
+                {
+                    perror("error completing get_header");
+                    return CONN_ERROR;
+                }
+                else if (res == CONN_CLOSED)
+                {
+                    perror("issue in client's req");
+                    return CONN_CLOSED;
+                }
+
+                // req_buffer becomes the send buffer, the aio reads overwrite it
+                conn->byte_offset = 0;
+                conn->bytes_read = 0;
+                conn->util_offset = 0;
+
+                block_cache_bind(conn);
+                if (read_chunk_event_driven(conn, global_aio_ctx, global_aio_event_fd) == CONN_ERROR)
+                {
+                    perror("Error preparing read operation in READING_HEADER-GET OP");
+                    return CONN_ERROR;
+                }
+                return CONN_ALIVE;
+            }
+            else if (slice_eq(req->method, "PUT"))
+            {
+                int res = handle_put_header(conn->fd, req, &conn->file_fd, &conn->file_size, NON_BLOCKING);
+                if (res == CONN_ERROR)
+                {
+                    perror("error completing put_header");
+                    return CONN_ERROR;
+                }
+                else if (res == CONN_CLOSED)
+                {
+                    perror("issue in client's req");
+                    return CONN_CLOSED;
+                }
+                libaio_direct_io(conn->file_fd);
+                // bytes past the body belong to pipelined requests
+                if (stash_pipelined(conn, header_len + conn->file_size) == CONN_ERROR)
+                    return CONN_ERROR;
+                conn->bytes_read = conn->bytes_read - header_len;
+                // move the content to the start
+                memmove(conn->req_buffer, conn->req_buffer + header_len, conn->bytes_read);
+                // set rest values as 0
+                memset(conn->req_buffer + conn->bytes_read, 0, BUFFER_SIZE - conn->bytes_read);
+                conn->byte_offset = 0;
+
+                if (conn->bytes_read > 0 && conn->bytes_read >= conn->file_size)
+                {
+                    // write whatever we have read into file
+                    conn->state = WAITING_FOR_AIO_WRITE;
+                    if (libaio_func(conn, WRITE_FILE, global_aio_ctx, global_aio_event_fd) == CONN_ERROR)
+                    {
+                        perror("Error preparing write operation in READING_HEADER-PUT OP");
+                        return CONN_ERROR;
+                    }
+                }
+                else
+                {
+                    conn->state = HANDLING_GET_IO; // to read the rest of the body
+                }
+                return CONN_ALIVE;
+            }
+            else
+            {
+                send_static_response(conn->fd, RESP_METHOD_NOT_ALLOWED);
+                return CONN_CLOSED;
+            }
+        }
+    }
+    else if (conn->state == WAITING_FOR_AIO_READ)
+    {
+
+        conn->byte_offset += conn->last_aio_res; // offset read in file
+        // conn->bytes_read = conn->last_aio_res;   // how much data we actually read
+        conn->util_offset = 0;          // send offset
+        conn->state = HANDLING_POST_IO; // we send to client what we just read
+        if (conn->last_aio_res == 0 && conn->byte_offset < conn->file_size)
+        {
+            fprintf(stderr, "Unexpected 0-byte read for FD %d. Client %d may have disconnected mid-transfer.\n", conn->file_fd, conn->fd);
+            return CONN_ERROR; // Or CONN_CLOSED if you assume disconnect
+        }
+        // else if (conn->last_aio_res == 0 && conn->byte_offset >= conn->file_size)
+        // {
+        //     // File fully read, sent all data, and now EOF. This is the successful end of GET.
+        //     send_static_response(conn->fd, RESP_FILE_SENT);
+        //     return CONN_CLOSED;
+        // }
+        return CONN_ALIVE;
+    }
+    else if (conn->state == HANDLING_POST_IO)
+    {
+        n = send_fully(conn->fd, conn->req_buffer + conn->util_offset,
+                       conn->last_aio_res - conn->util_offset, NON_BLOCKING);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONN_ALIVE; // Sent partial, wait for next EPOLLOUT
+            perror("Error sending blocking data");
+            return CONN_ERROR;
+        }
+        conn->util_offset += n; // offset sent to client
+        if (conn->util_offset < conn->last_aio_res)
+        {
+            // Still more data to send from current buffer, wait for next EPOLLOUT
+            return CONN_ALIVE;
+        }
+
+        // Current buffer sent completely
+        block_cache_store(conn, conn->byte_offset - conn->last_aio_res, conn->req_buffer, conn->last_aio_res);
+        conn->util_offset = 0; // Reset for next buffer
+        if (conn->byte_offset >= conn->file_size)
+        {
+            // the 200 header already went out, the body is the whole response
+            return finish_request_event_driven(global_aio_ctx, global_aio_event_fd, conn);
+        }
+        else
+        {
+            // continue reading more data from file
+            if (read_chunk_event_driven(conn, global_aio_ctx, global_aio_event_fd) == CONN_ERROR)
+            {
+                perror("Error preparing read operation in HANDLING_POST_IO");
+                return CONN_ERROR;
+            }
+            return CONN_ALIVE;
+        }
+    }
+    else if (conn->state == WAITING_FOR_AIO_WRITE)
+    {
+        size_t s_res = conn->last_aio_res;
+        conn->byte_offset += s_res; // offset written in file
+        if (s_res == 0 && conn->byte_offset < conn->file_size)
+        {
+            fprintf(stderr, "Unexpected 0-byte write for FD %d. Disk full or write error.\n", conn->file_fd);
+            return CONN_ERROR;
+        }
+        if (conn->byte_offset >= conn->file_size)
+        {
+            send_static_response(conn->fd, RESP_CREATED);
+            return finish_request_event_driven(global_aio_ctx, global_aio_event_fd, conn);
+        }
+
+        if (conn->bytes_read == s_res)
+        {
+            conn->bytes_read = 0;
+            conn->state = HANDLING_GET_IO;
+            return CONN_ALIVE;
+        }
+        else if (conn->bytes_read > s_res)
+        {
+            // keep reading to fillbuffer
+            size_t bytes_remaining = conn->bytes_read - s_res;
+            memmove(conn->req_buffer, conn->req_buffer + s_res, bytes_remaining);
+            memset(conn->req_buffer + bytes_remaining, 0, BUFFER_SIZE - bytes_remaining);
+            conn->state = HANDLING_GET_IO;
+            return CONN_ALIVE;
+        }
+        else
+        {
+            // we probably wrote our last bit and should have sent read the entire file
+            printf("SHOULDNT HAPPEN---------bytes_read=%zd, res=%zd, offset=%zd, fsize=%zd\n", conn->bytes_read, s_res, conn->byte_offset, conn->file_size);
+        }
+
+        return CONN_ALIVE;
+    }
+    else if (conn->state == HANDLING_GET_IO)
+    {
+        // never read past the body, the next pipelined request stays in the socket
+        size_t to_recv = BUFFER_SIZE - conn->bytes_read;
+        if (conn->file_size - conn->byte_offset - conn->bytes_read < to_recv)
+            to_recv = conn->file_size - conn->byte_offset - conn->bytes_read;
+        n = recv(conn->fd, conn->req_buffer + conn->bytes_read, to_recv, 0);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONN_ALIVE;
+            perror("Client stopped sending");
+            send_static_response(conn->fd, RESP_MALFORMED);
+            return CONN_CLOSED;
+        }
+        else if (n == 0)
+        {
+            if (conn->byte_offset >= conn->file_size)
+            {
+                send_static_response(conn->fd, RESP_CREATED);
+                return CONN_CLOSED;
+            }
+            perror("Client disconnected");
+            send_static_response(conn->fd, RESP_CLIENT_DISCONNECTED);
+            return CONN_CLOSED;
+        }
+        conn->bytes_read += n;
+
+        if (conn->bytes_read == BUFFER_SIZE || (conn->byte_offset + conn->bytes_read >= conn->file_size))
+        {
+            /*
+            if (conn->byte_offset + conn->bytes_read > conn->file_size)
+            {
+                conn->bytes_read = conn->file_size - conn->byte_offset;
+            }*/
+            conn->state = WAITING_FOR_AIO_WRITE;
+            if (libaio_func(conn, WRITE_FILE, global_aio_ctx, global_aio_event_fd) == CONN_ERROR)
+            {
+                perror("Error preparing write op in HANDLING_GET_IO");
+                return CONN_ERROR;
+            }
+            // conn->bytes_read = 0;                 // Reset for next recv
+            return CONN_ALIVE;
+        }
+        return CONN_ALIVE;
+    }
+
+    else
+    {
+        fprintf(stderr, "Incorect state to complete request\n");
+        send_static_response(conn->fd, RESP_REQUEST_ERROR);
+        return CONN_CLOSED;
+    }
+    return CONN_ALIVE;
+}
+
+// HTTP_TASKRUN=default|coop|defer overrides TASKRUN_MODE without a rebuild
+static taskrun_mode runtime_taskrun_mode()
+{
+    static int mode = -1;
+    if (mode == -1)
+    {
+        const char *env = getenv("HTTP_TASKRUN");
+        if (env && strcmp(env, "default") == 0)
+            mode = TASKRUN_DEFAULT;
+        else if (env && strcmp(env, "coop") == 0)
+            mode = TASKRUN_COOP;
+        else if (env && strcmp(env, "defer") == 0)
+            mode = TASKRUN_DEFER;
+        else
+            mode = TASKRUN_MODE;
+    }
+    return mode;
+}
+
+// optional setup flags, newest kernel first: that is the order they are given up in
+static const struct
+{
+    unsigned flags;
+    const char *name;
+} ring_setup_flags[] = {
+    {IORING_SETUP_DEFER_TASKRUN, "DEFER_TASKRUN"},                         // 6.1
+    {IORING_SETUP_SINGLE_ISSUER, "SINGLE_ISSUER"},                         // 6.0
+    {IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG, "COOP_TASKRUN"}, // 5.19
+    {IORING_SETUP_SUBMIT_ALL, "SUBMIT_ALL"},                               // 5.18
+    {IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP, "CQSIZE"},                  // 5.5
+};
+#define RING_SETUP_FLAG_COUNT (sizeof(ring_setup_flags) / sizeof(ring_setup_flags[0]))
 
-    // precautionary
-    if (get_req_counter() >= BATCH_SIZE)
+// creates the ring with the caller's params plus every optional flag the kernel takes. an older
+// kernel rejects unknown flags with EINVAL, so the newest one is dropped until the setup succeeds.
+// task work flags don't combine with SQPOLL, the SQ thread runs it. prints what it got
+int setup_ring(unsigned entries, struct io_uring *ring, struct io_uring_params *params, int worker)
+{
+    struct io_uring_params base = *params;
+    unsigned wanted = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP |
+                      IORING_SETUP_SINGLE_ISSUER;
+    taskrun_mode mode = runtime_taskrun_mode();
+    if (!(base.flags & IORING_SETUP_SQPOLL) && mode != TASKRUN_DEFAULT)
+        wanted |= IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG;
+    if (!(base.flags & IORING_SETUP_SQPOLL) && mode == TASKRUN_DEFER)
+        wanted |= IORING_SETUP_DEFER_TASKRUN;
+
+    int ret;
+    size_t drop = 0;
+    while (1)
     {
-        submit_iocbs(*ctx_ptr);
+        *params = base;
+        params->flags |= wanted;
+        if (wanted & IORING_SETUP_CQSIZE)
+            params->cq_entries = entries * CQ_RING_FACTOR;
+        ret = io_uring_queue_init_params(entries, ring, params);
+        if (ret != -EINVAL || wanted == 0)
+            break;
+        while (drop < RING_SETUP_FLAG_COUNT && !(wanted & ring_setup_flags[drop].flags))
+            drop++;
+        if (drop == RING_SETUP_FLAG_COUNT)
+            break;
+        wanted &= ~ring_setup_flags[drop].flags;
     }
+    if (ret < 0)
+        return ret;
 
-    add_to_iocbs(&conn->aio_iocb);
+    char report[256];
+    int len = snprintf(report, sizeof(report), "ring %d: %u SQ / %u CQ entries%s", worker, params->sq_entries,
+                       params->cq_entries, (base.flags & IORING_SETUP_SQPOLL) ? ", SQPOLL" : "");
+    for (size_t i = RING_SETUP_FLAG_COUNT; i-- > 0 && len < (int)sizeof(report);)
+        if (wanted & ring_setup_flags[i].flags)
+            len += snprintf(report + len, sizeof(report) - len, ", %s", ring_setup_flags[i].name);
+    // enter calls skip the fd table lookup, per thread so each worker registers its own
+    if (len < (int)sizeof(report) && io_uring_register_ring_fd(ring) == 1)
+        len += snprintf(report + len, sizeof(report) - len, ", registered ring fd");
+    printf("%s\n", report);
+    return 0;
+}
+
+// uring state below is per thread so sharded servers run one ring per worker without sharing
+// provided buffer ring for uring recvs, NULL when not set up
+static __thread struct io_uring_buf_ring *buf_ring = NULL;
+static __thread char *buf_ring_pool = NULL;
+
+int setup_buf_ring(struct io_uring *ring)
+{
+    int ret;
+    // every recv lands here, huge pages keep the whole pool within a few TLB entries
+    buf_ring_pool = io_pool_map((size_t)BUF_RING_ENTRIES * BUFFER_SIZE, 1);
+    if (!buf_ring_pool)
+        return CONN_ERROR;
+    buf_ring = io_uring_setup_buf_ring(ring, BUF_RING_ENTRIES, BUF_RING_GROUP_ID, 0, &ret);
+    if (!buf_ring)
+    {
+        fprintf(stderr, "Failed to register buffer ring: %s\n", strerror(-ret));
+        io_pool_unmap(buf_ring_pool, (size_t)BUF_RING_ENTRIES * BUFFER_SIZE);
+        buf_ring_pool = NULL;
+        return CONN_ERROR;
+    }
+    for (int i = 0; i < BUF_RING_ENTRIES; i++)
+    {
+        io_uring_buf_ring_add(buf_ring, buf_ring_pool + (size_t)i * BUFFER_SIZE, BUFFER_SIZE, i,
+                              io_uring_buf_ring_mask(BUF_RING_ENTRIES), i);
+    }
+    io_uring_buf_ring_advance(buf_ring, BUF_RING_ENTRIES);
     return CONN_ALIVE;
 }
 
-int handle_requests_event_driven(io_context_t *global_aio_ctx, int *global_aio_event_fd, conn_state *conn)
+int buf_ring_enabled() { return buf_ring != NULL; }
+
+// conn keeps the kernel picked buffer as its req_buffer until the request is done
+void adopt_provided_buf(conn_state *conn, struct io_uring_cqe *cqe)
 {
-    char method[16], path[1024];
-    ssize_t n;
+    conn->buf_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    conn->req_buffer = buf_ring_pool + (size_t)conn->buf_id * BUFFER_SIZE;
+}
 
-    if (conn->state == READING_HEADER)
+void recycle_provided_buf(conn_state *conn)
+{
+    io_uring_buf_ring_add(buf_ring, conn->req_buffer, BUFFER_SIZE, conn->buf_id,
+                          io_uring_buf_ring_mask(BUF_RING_ENTRIES), 0);
+    io_uring_buf_ring_advance(buf_ring, 1);
+    conn->req_buffer = NULL;
+    conn->buf_id = -1;
+}
+
+// the ring ran dry (-ENOBUFS): recv into a pool buffer instead of resubmitting into the empty ring,
+// reset_conn hands it back once the request is done
+int borrow_recv_buffer(conn_state *conn)
+{
+    if (!conn->req_buffer && !(conn->req_buffer = io_buffer_get()))
+        return CONN_ERROR;
+    return CONN_ALIVE;
+}
+
+// sparse registered file table and free slot stack, ring is NULL when not set up
+static __thread struct io_uring *file_table_ring = NULL;
+static __thread int free_file_slots[FIXED_FILE_SLOTS];
+static __thread int free_file_slot_count = 0;
+static __thread int fixed_bufs_enabled = 0;
+
+static int register_buf_ring_pool(struct io_uring *ring)
+{
+    struct iovec iovecs[BUF_RING_ENTRIES];
+    for (int i = 0; i < BUF_RING_ENTRIES; i++)
     {
-        n = recv(conn->fd, conn->req_buffer + conn->bytes_read, BUFFER_SIZE - conn->bytes_read, 0);
+        iovecs[i].iov_base = buf_ring_pool + (size_t)i * BUFFER_SIZE;
+        iovecs[i].iov_len = BUFFER_SIZE;
+    }
+    return io_uring_register_buffers(ring, iovecs, BUF_RING_ENTRIES);
+}
 
-        if (n < 0)
-        {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-                return CONN_ALIVE;
-            perror("Client stopped sending");
-            send_response(conn->fd, "HTTP/1.1 400 Bad Request", "text/plain", "Malformed Request.");
-            return CONN_CLOSED;
-        }
-        else if (n == 0)
-        {
-            perror("Client disconnected");
-            send_response(conn->fd, "HTTP/1.1 400 Bad Request", "text/plain", "Client Disconnected");
-            return CONN_CLOSED;
-        }
-        conn->bytes_read += n;
+int setup_registered_io(struct io_uring *ring)
+{
+    int ret = io_uring_register_files_sparse(ring, FIXED_FILE_SLOTS);
+    if (ret < 0)
+        fprintf(stderr, "Failed to register sparse file table: %s\n", strerror(-ret));
+    else
+    {
+        for (int i = 0; i < FIXED_FILE_SLOTS; i++)
+            free_file_slots[i] = FIXED_FILE_SLOTS - 1 - i;
+        free_file_slot_count = FIXED_FILE_SLOTS;
+        file_table_ring = ring;
+    }
 
-        if (conn->bytes_read < BUFFER_SIZE)
-        {
-            conn->req_buffer[conn->bytes_read] = '\0';
-        }
-        // if we have full header request
+    // the provided buffer pool doubles as the fixed buffer table, buf_id is the buf_index
+    if (buf_ring_pool)
+    {
+        ret = register_buf_ring_pool(ring);
+        if (ret < 0)
+            fprintf(stderr, "Failed to register fixed buffers: %s\n", strerror(-ret));
+        else
+            fixed_bufs_enabled = 1;
+    }
 
-        if (strstr(conn->req_buffer, "\r\n\r\n"))
-        {
-            sscanf(conn->req_buffer, "%s %s", method, path);
-            printf("Received request:\n%s %s\n", method, path);
+    if (!file_table_ring && !fixed_bufs_enabled)
+        return CONN_ERROR;
+    return CONN_ALIVE;
+}
 
-            // Handle GET method
-            if (strcmp(method, "GET") == 0)
-            {
-                int res = handle_get_header(conn->fd, path, &conn->file_fd,
-                                            &conn->file_size, NON_BLOCKING);
-                if (res == CONN_ERROR)
-                {
-                    perror("error completing get_header");
-                    return CONN_ERROR;
-                }
-                else if (res == CONN_CLOSED)
-                {
-                    perror("issue in client's req");
-                    return CONN_CLOSED;
-                }
+// registering and clearing a slot are a syscall each, so slots follow the fd cache: a cached file is
+// registered once on its first request and stays so until the entry is freed
+static int take_file_slot(int fd)
+{
+    if (!file_table_ring || free_file_slot_count == 0 || fd == -1)
+        return -1; // plain fd still works
 
-                memset(conn->req_buffer, 0, BUFFER_SIZE); // use the req_buffer as send buffer
-                conn->byte_offset = 0;
-                conn->bytes_read = 0;
-                conn->util_offset = 0;
+    int slot = free_file_slots[free_file_slot_count - 1];
+    int ret = io_uring_register_files_update(file_table_ring, slot, &fd, 1);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to register file in slot %d: %s\n", slot, strerror(-ret));
+        return -1;
+    }
+    free_file_slot_count--;
+    return slot;
+}
 
-                conn->state = WAITING_FOR_AIO_READ;
-                if (libaio_func(conn, READ_FILE, global_aio_ctx, global_aio_event_fd) == CONN_ERROR)
-                {
-                    perror("Error preparing read operation in READING_HEADER-GET OP");
-                    return CONN_ERROR;
-                }
-                return CONN_ALIVE;
-            }
-            else if (strcmp(method, "PUT") == 0)
-            {
-                char *body_start = strstr(conn->req_buffer, "\r\n\r\n");
-                if (!body_start)
-                {
-                    send_response(conn->fd, "HTTP/1.1 400 Bad Request", "text/plain", "Malformed headers.");
-                    return CONN_CLOSED;
-                }
-                int res = handle_put_header(conn->fd, path, &conn->file_fd, &conn->file_size, conn->req_buffer, NON_BLOCKING);
-                if (res == CONN_ERROR)
-                {
-                    perror("error completing put_header");
-                    return CONN_ERROR;
-                }
-                else if (res == CONN_CLOSED)
-                {
-                    perror("issue in client's req");
-                    return CONN_CLOSED;
-                }
-                body_start += 4; // Skip past the "\r\n\r\n"
-                size_t initial_body_len = conn->bytes_read - (body_start - conn->req_buffer);
-                if (initial_body_len < 0)
-                    initial_body_len = 0;
+static void drop_file_slot(int slot)
+{
+    if (!file_table_ring || slot == -1)
+        return;
+    int empty = -1;
+    io_uring_register_files_update(file_table_ring, slot, &empty, 1);
+    free_file_slots[free_file_slot_count++] = slot;
+}
 
-                conn->bytes_read = initial_body_len;
-                // move the content to the start
-                memmove(conn->req_buffer, body_start, conn->bytes_read);
-                // set rest values as 0
-                memset(conn->req_buffer + conn->bytes_read, 0, BUFFER_SIZE - conn->bytes_read);
-                conn->byte_offset = 0;
+void register_conn_file(conn_state *conn)
+{
+    if (conn->file_entry)
+    {
+        if (conn->file_entry->file_slot == -1)
+            conn->file_entry->file_slot = take_file_slot(conn->file_fd);
+        conn->file_slot = conn->file_entry->file_slot;
+    }
+    else if (conn->file_size > BUFFER_SIZE)
+        conn->file_slot = take_file_slot(conn->file_fd); // a private fd only pays off over several ops
+}
 
-                if (conn->bytes_read > 0 && conn->bytes_read >= conn->file_size)
-                {
-                    // write whatever we have read into file
-                    conn->state = WAITING_FOR_AIO_WRITE;
-                    if (libaio_func(conn, WRITE_FILE, global_aio_ctx, global_aio_event_fd) == CONN_ERROR)
-                    {
-                        perror("Error preparing write operation in READING_HEADER-PUT OP");
-                        return CONN_ERROR;
-                    }
-                }
-                else
-                {
-                    conn->state = HANDLING_GET_IO; // to read the rest of the body
-                }
-                return CONN_ALIVE;
-            }
-            else
+void release_conn_file(conn_state *conn)
+{
+    if (conn->file_slot != -1 && !conn->file_entry)
+        drop_file_slot(conn->file_slot);
+    conn->file_slot = -1;
+}
+
+// optional IOPOLL ring for the O_DIRECT reads and writes of a socket ring. the loop thread fills
+// and submits it, a poller thread reaps it (IOPOLL completions only show up when someone polls)
+// and cross-posts every CQE to the socket ring with IORING_OP_MSG_RING, so the loop handles it like
+// any other completion of the conn. the poller sleeps on a futex while nothing is in flight
+typedef struct
+{
+    struct io_uring ring;     // IOPOLL, SQ side belongs to the loop thread, CQ side to the poller
+    int target_fd;            // socket ring the completions are posted to
+    int fixed_bufs;           // the provided buffer pool is registered here too
+    _Atomic uint32_t inflight; // submitted and not cross-posted yet, futex word
+    atomic_int sleeping;
+    int unsupported;          // a polled op failed with -EOPNOTSUPP, new ops stay on the socket ring
+    pthread_t poller;
+} file_ring_state;
+
+static __thread file_ring_state *file_ring = NULL;
+
+static void *file_ring_poller(void *arg)
+{
+    file_ring_state *fr = arg;
+    struct io_uring courier; // MSG_RING SQEs need a ring of the poller's own
+    if (io_uring_queue_init(FILE_RING_DEPTH, &courier, 0) < 0)
+    {
+        fprintf(stderr, "File ring poller: failed to set up its courier ring\n");
+        return NULL;
+    }
+    while (1)
+    {
+        if (atomic_load(&fr->inflight) == 0)
+        {
+            atomic_store(&fr->sleeping, 1);
+            if (atomic_load(&fr->inflight) == 0)
+                syscall(SYS_futex, &fr->inflight, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+            atomic_store(&fr->sleeping, 0);
+            continue;
+        }
+        struct io_uring_cqe *cqe;
+        int ret = io_uring_wait_cqe(&fr->ring, &cqe); // polls the device
+        if (ret < 0)
+        {
+            if (ret != -EINTR && ret != -EAGAIN)
+                fprintf(stderr, "File ring poll failed: %s\n", strerror(-ret));
+            continue;
+        }
+        unsigned head, reaped = 0;
+        io_uring_for_each_cqe(&fr->ring, head, cqe)
+        {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&courier);
+            if (!sqe)
             {
-                send_response(conn->fd, "HTTP/1.1 405 Method Not Allowed", "text/plain", "Method Not Allowed.");
-                return CONN_CLOSED;
+                io_uring_submit(&courier);
+                sqe = io_uring_get_sqe(&courier);
             }
+            io_uring_prep_msg_ring(sqe, fr->target_fd, cqe->res, io_uring_cqe_get_data64(cqe), 0);
+            sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+            reaped++;
+        }
+        io_uring_cq_advance(&fr->ring, reaped);
+        io_uring_submit(&courier);
+        atomic_fetch_sub(&fr->inflight, reaped);
+
+        // only failed cross-posts leave a CQE, that conn never hears back from its file op
+        while (io_uring_peek_cqe(&courier, &cqe) == 0)
+        {
+            fprintf(stderr, "File ring completion lost: %s\n", strerror(-cqe->res));
+            io_uring_cqe_seen(&courier, cqe);
         }
     }
-    else if (conn->state == WAITING_FOR_AIO_READ)
+    return NULL;
+}
+
+// an IOPOLL ring sets up fine on any kernel, but reads only work where the filesystem and device
+// poll. one O_DIRECT read of a file under ROOT before the ring is used tells
+static int probe_file_ring(struct io_uring *poll_ring)
+{
+    DIR *dir = opendir(ROOT);
+    if (!dir)
     {
+        perror("Failed to open ROOT for the file ring probe");
+        return CONN_ERROR;
+    }
+    int fd = -1;
+    struct dirent *ent;
+    while (fd == -1 && (ent = readdir(dir)))
+    {
+        struct stat st;
+        if (fstatat(dirfd(dir), ent->d_name, &st, 0) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+            fd = openat(dirfd(dir), ent->d_name, O_RDONLY | O_DIRECT);
+    }
+    closedir(dir);
+    if (fd == -1)
+    {
+        fprintf(stderr, "No O_DIRECT readable file under %s to probe the file ring with\n", ROOT);
+        return CONN_ERROR;
+    }
 
-        conn->byte_offset += conn->last_aio_res; // offset read in file
-        // conn->bytes_read = conn->last_aio_res;   // how much data we actually read
-        conn->util_offset = 0;          // send offset
-        conn->state = HANDLING_POST_IO; // we send to client what we just read
-        if (conn->last_aio_res == 0 && conn->byte_offset < conn->file_size)
+    char *buf = NULL;
+    int ret = -ENOMEM;
+    struct io_uring_sqe *sqe = io_uring_get_sqe(poll_ring);
+    if (sqe && posix_memalign((void **)&buf, MY_BLOCK_SIZE, MY_BLOCK_SIZE) == 0)
+    {
+        io_uring_prep_read(sqe, fd, buf, MY_BLOCK_SIZE, 0);
+        struct io_uring_cqe *cqe;
+        ret = io_uring_submit_and_wait(poll_ring, 1);
+        if (ret >= 0)
+            ret = io_uring_wait_cqe(poll_ring, &cqe);
+        if (ret == 0)
         {
-            fprintf(stderr, "Unexpected 0-byte read for FD %d. Client %d may have disconnected mid-transfer.\n", conn->file_fd, conn->fd);
-            return CONN_ERROR; // Or CONN_CLOSED if you assume disconnect
+            ret = cqe->res;
+            io_uring_cqe_seen(poll_ring, cqe);
         }
-        // else if (conn->last_aio_res == 0 && conn->byte_offset >= conn->file_size)
-        // {
-        //     // File fully read, sent all data, and now EOF. This is the successful end of GET.
-        //     send_response(conn->fd, "HTTP/1.1 200 OK", "text/plain", "File sent.");
-        //     return CONN_CLOSED;
-        // }
-        return CONN_ALIVE;
     }
-    else if (conn->state == HANDLING_POST_IO)
+    free(buf);
+    close(fd);
+    if (ret < 0)
     {
-        n = send_fully(conn->fd, conn->req_buffer + conn->util_offset,
-                       conn->last_aio_res - conn->util_offset, NON_BLOCKING);
-        if (n < 0)
+        fprintf(stderr, "IOPOLL read on %s failed: %s\n", ROOT, strerror(-ret));
+        return CONN_ERROR;
+    }
+    return CONN_ALIVE;
+}
+
+int setup_file_ring(struct io_uring *ring)
+{
+    file_ring_state *fr = calloc(1, sizeof(file_ring_state));
+    if (!fr)
+        return CONN_ERROR;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_IOPOLL;
+    int ret = io_uring_queue_init_params(FILE_RING_DEPTH, &fr->ring, &params);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to set up IOPOLL file ring: %s\n", strerror(-ret));
+        free(fr);
+        return CONN_ERROR;
+    }
+    struct io_uring_probe *probe = io_uring_get_probe_ring(ring);
+    int msg_ring = probe && io_uring_opcode_supported(probe, IORING_OP_MSG_RING);
+    if (probe)
+        io_uring_free_probe(probe);
+    if (!msg_ring || probe_file_ring(&fr->ring) < 0)
+    {
+        io_uring_queue_exit(&fr->ring);
+        free(fr);
+        return CONN_ERROR;
+    }
+    // O_DIRECT is where fixed buffers pay most, the pages stay pinned across reads
+    fr->fixed_bufs = fixed_bufs_enabled && register_buf_ring_pool(&fr->ring) == 0;
+    fr->target_fd = ring->ring_fd;
+    if (pthread_create(&fr->poller, NULL, file_ring_poller, fr) != 0)
+    {
+        perror("Failed to start file ring poller");
+        io_uring_queue_exit(&fr->ring);
+        free(fr);
+        return CONN_ERROR;
+    }
+    file_ring = fr;
+    return CONN_ALIVE;
+}
+
+int file_ring_enabled()
+{
+    return file_ring != NULL && !file_ring->unsupported;
+}
+
+// a file ring op came back -EOPNOTSUPP (a file on a filesystem or device the startup probe didn't
+// cover): stop queueing on the file ring and resubmit the op on the socket ring. CONN_ERROR when the
+// failed op wasn't a file ring read or write
+int file_ring_fallback(struct io_uring *ring, conn_state *conn)
+{
+    async_func_enum func;
+    if (!file_ring || !conn->file_direct)
+        return CONN_ERROR;
+    if (conn->state == HANDLING_GET && conn->last_op == OP_READ)
+        func = READ_FILE;
+    else if (conn->state == HANDLING_POST && conn->last_op == OP_WRITE)
+        func = WRITE_FILE;
+    else
+        return CONN_ERROR;
+    if (!file_ring->unsupported)
+    {
+        fprintf(stderr, "IOPOLL file ring: %s, file I/O goes back to the socket ring\n", strerror(EOPNOTSUPP));
+        file_ring->unsupported = 1;
+    }
+    return io_uring_func(ring, conn, func);
+}
+
+// hands everything queued on the file ring to the kernel and wakes the poller if it sleeps
+static void file_ring_flush()
+{
+    if (!file_ring || io_uring_sq_ready(&file_ring->ring) == 0)
+        return;
+    int submitted = io_uring_submit(&file_ring->ring);
+    if (submitted <= 0)
+        return;
+    if (atomic_fetch_add(&file_ring->inflight, submitted) == 0 && atomic_load(&file_ring->sleeping))
+        syscall(SYS_futex, &file_ring->inflight, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// READ_FILE / WRITE_FILE of an O_DIRECT conn file on the file ring, goes out with the next flush
+static int queue_file_ring_op(conn_state *conn, async_func_enum func)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&file_ring->ring);
+    if (!sqe)
+    {
+        file_ring_flush();
+        if (!(sqe = io_uring_get_sqe(&file_ring->ring)))
         {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-                return CONN_ALIVE; // Sent partial, wait for next EPOLLOUT
-            perror("Error sending blocking data");
+            fprintf(stderr, "File ring full\n");
             return CONN_ERROR;
         }
-        conn->util_offset += n; // offset sent to client
-        if (conn->util_offset < conn->last_aio_res)
-        {
-            // Still more data to send from current buffer, wait for next EPOLLOUT
-            return CONN_ALIVE;
-        }
+    }
+    // buf_id indexes the pool registered on both rings, the file slot only exists on the socket ring
+    int fixed_buf = file_ring->fixed_bufs && conn->buf_id != -1;
+    if (func == READ_FILE && fixed_buf)
+        io_uring_prep_read_fixed(sqe, conn->file_fd, conn->req_buffer, BUFFER_SIZE, conn->byte_offset, conn->buf_id);
+    else if (func == READ_FILE)
+        io_uring_prep_read(sqe, conn->file_fd, conn->req_buffer, BUFFER_SIZE, conn->byte_offset);
+    else if (fixed_buf)
+        io_uring_prep_write_fixed(sqe, conn->file_fd, conn->req_buffer, BUFFER_SIZE, conn->byte_offset, conn->buf_id);
+    else
+        io_uring_prep_write(sqe, conn->file_fd, conn->req_buffer, BUFFER_SIZE, conn->byte_offset);
+    io_uring_sqe_set_data64(sqe, conn_handle(conn));
+    increment_req_counter(); // flushed by the socket ring's submission policy
+    return CONN_ALIVE;
+}
+
+// when queued SQEs go to the kernel: once SUBMIT_BATCH has accumulated, once the oldest has
+// waited SUBMIT_LATENCY_US, or once the CQ is drained and nothing else would join the batch.
+// the size threshold doubles while batches keep filling and halves when the latency budget
+// fires first, so a loaded loop amortizes the submit and a quiet one doesn't hold SQEs back
+static __thread unsigned sq_pending = 0;
+static __thread unsigned sq_batch = SUBMIT_BATCH_MIN;
+static __thread struct timespec sq_oldest; // when the first pending SQE was queued
+static __thread unsigned long sq_flushes[SUBMIT_REASONS];
+static __thread unsigned long sq_submitted = 0;
+
+void submit_policy_queued()
+{
+    if (sq_pending++ == 0)
+        clock_gettime(CLOCK_MONOTONIC, &sq_oldest);
+}
+
+// the caller submitted on its own (ring full, startup), file ring SQEs go along
+void submit_policy_reset()
+{
+    sq_pending = 0;
+    file_ring_flush();
+}
+
+int submit_policy_pending()
+{
+    return sq_pending;
+}
+
+static void submit_policy_account(submit_reason why)
+{
+    if (why == SUBMIT_BY_SIZE && sq_batch < SUBMIT_BATCH_MAX)
+        sq_batch <<= 1;
+    else if (why == SUBMIT_BY_LATENCY && sq_batch > SUBMIT_BATCH_MIN)
+        sq_batch >>= 1;
+    sq_flushes[why]++;
+    sq_submitted += sq_pending;
+    sq_pending = 0;
+    file_ring_flush();
+}
+
+// call after every completion, drained once the loop has no completions left to handle
+int submit_policy_flush(struct io_uring *ring, int drained)
+{
+    if (sq_pending == 0)
+        return 0;
+    submit_reason why;
+    if (sq_pending >= sq_batch)
+        why = SUBMIT_BY_SIZE;
+    else if (drained)
+        why = SUBMIT_BY_DRAIN;
+    else
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long waited_us = (now.tv_sec - sq_oldest.tv_sec) * 1000000 + (now.tv_nsec - sq_oldest.tv_nsec) / 1000;
+        if (waited_us < SUBMIT_LATENCY_US)
+            return 0;
+        why = SUBMIT_BY_LATENCY;
+    }
+    submit_policy_account(why);
+    return io_uring_submit(ring);
+}
+
+// the loop is about to block, whatever is queued goes out with the wait. ts bounds the wait
+int submit_policy_wait(struct io_uring *ring, unsigned wait_nr, struct __kernel_timespec *ts)
+{
+    if (sq_pending > 0)
+        submit_policy_account(SUBMIT_BY_DRAIN);
+    if (!ts)
+        return io_uring_submit_and_wait(ring, wait_nr);
+    struct io_uring_cqe *cqe;
+    return io_uring_submit_and_wait_timeout(ring, &cqe, wait_nr, ts, NULL);
+}
 
-        // Current buffer sent completely
-        conn->util_offset = 0; // Reset for next buffer
-        if (conn->byte_offset >= conn->file_size)
-        {
-            send_response(conn->fd, "HTTP/1.1 200 OK", "text/plain", "File sent.");
-            return CONN_CLOSED;
-        }
+// HTTP_WAIT=spin|block|hybrid overrides WAIT_STRATEGY without a rebuild
+static wait_strategy runtime_wait_strategy()
+{
+    static int strategy = -1;
+    if (strategy == -1)
+    {
+        const char *env = getenv("HTTP_WAIT");
+        if (env && strcmp(env, "spin") == 0)
+            strategy = WAIT_SPIN;
+        else if (env && strcmp(env, "block") == 0)
+            strategy = WAIT_BLOCK;
+        else if (env && strcmp(env, "hybrid") == 0)
+            strategy = WAIT_HYBRID;
         else
-        {
-            conn->state = WAITING_FOR_AIO_READ; // continue reading more data from file
-            if (libaio_func(conn, READ_FILE, global_aio_ctx, global_aio_event_fd) == CONN_ERROR)
-            {
-                perror("Error preparing read operation in HANDLING_POST_IO");
-                return CONN_ERROR;
-            }
-            return CONN_ALIVE;
-        }
+            strategy = WAIT_STRATEGY;
     }
-    else if (conn->state == WAITING_FOR_AIO_WRITE)
+    return strategy;
+}
+
+const char *ring_wait_describe()
+{
+    static __thread char text[96];
+    switch (runtime_wait_strategy())
     {
-        size_t s_res = conn->last_aio_res;
-        conn->byte_offset += s_res; // offset written in file
-        if (s_res == 0 && conn->byte_offset < conn->file_size)
-        {
-            fprintf(stderr, "Unexpected 0-byte write for FD %d. Disk full or write error.\n", conn->file_fd);
-            return CONN_ERROR;
-        }
-        if (conn->byte_offset >= conn->file_size)
-        {
-            send_response(conn->fd, "HTTP/1.1 201 Created", "text/plain", "File uploaded.");
-            return CONN_CLOSED;
-        }
+    case WAIT_SPIN:
+        return "spin";
+    case WAIT_BLOCK:
+        snprintf(text, sizeof(text), "block (batch %d / %dus)", WAIT_BATCH, WAIT_BATCH_US);
+        return text;
+    default:
+        snprintf(text, sizeof(text), "hybrid (spin %dus / %d polls, batch %d / %dus)", WAIT_SPIN_US,
+                 WAIT_SPIN_ITERS, WAIT_BATCH, WAIT_BATCH_US);
+        return text;
+    }
+}
 
-        if (conn->bytes_read == s_res)
-        {
-            conn->bytes_read = 0;
-            conn->state = HANDLING_GET_IO;
-            return CONN_ALIVE;
-        }
-        else if (conn->bytes_read > s_res)
-        {
-            // keep reading to fillbuffer
-            size_t bytes_remaining = conn->bytes_read - s_res;
-            memmove(conn->req_buffer, conn->req_buffer + s_res, bytes_remaining);
-            memset(conn->req_buffer + bytes_remaining, 0, BUFFER_SIZE - bytes_remaining);
-            conn->state = HANDLING_GET_IO;
-            return CONN_ALIVE;
-        }
-        else
-        {
-            // we probably wrote our last bit and should have sent read the entire file
-            printf("SHOULDNT HAPPEN---------bytes_read=%zd, res=%zd, offset=%zd, fsize=%zd\n", conn->bytes_read, s_res, conn->byte_offset, conn->file_size);
-        }
+static __thread unsigned long wait_ready = 0;     // completions were already there
+static __thread unsigned long wait_spun = 0;      // spinning found completions
+static __thread unsigned long wait_blocked = 0;   // went to sleep in the kernel
+static __thread unsigned long wait_timed_out = 0; // batched sleeps that came back empty
+static __thread uint64_t wait_spin_ns = 0;        // time spent polling, the idle CPU cost
+static __thread int wait_idle = 0;                // last batched sleep came back empty, sleep untimed
 
-        return CONN_ALIVE;
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+static uint64_t elapsed_ns(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000000ULL + now.tv_nsec - since->tv_nsec;
+}
+
+// returns once the CQ has completions, or once a batched sleep ran out. queued SQEs are
+// submitted before anything waits on them
+void ring_wait(struct io_uring *ring)
+{
+    if (io_uring_cq_ready(ring))
+    {
+        wait_ready++;
+        submit_policy_flush(ring, 1);
+        return;
     }
-    else if (conn->state == HANDLING_GET_IO)
+    wait_strategy strategy = runtime_wait_strategy();
+    if (strategy != WAIT_BLOCK)
     {
-        n = recv(conn->fd, conn->req_buffer + conn->bytes_read, BUFFER_SIZE - conn->bytes_read, 0);
-        if (n < 0)
-        {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-                return CONN_ALIVE;
-            perror("Client stopped sending");
-            send_response(conn->fd, "HTTP/1.1 400 Bad Request", "text/plain", "Malformed Request.");
-            return CONN_CLOSED;
-        }
-        else if (n == 0)
+        submit_policy_flush(ring, 1);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (unsigned long polls = 1;; polls++)
         {
-            if (conn->byte_offset >= conn->file_size)
+            // coop/deferred task work only posts its CQEs once the loop enters the kernel
+            if (IO_URING_READ_ONCE(*ring->sq.kflags) & IORING_SQ_TASKRUN)
+                io_uring_get_events(ring);
+            if (io_uring_cq_ready(ring))
             {
-                send_response(conn->fd, "HTTP/1.1 201 Created", "text/plain", "File uploaded.");
-                return CONN_CLOSED;
+                wait_spun++;
+                wait_spin_ns += elapsed_ns(&start);
+                return;
             }
-            perror("Client disconnected");
-            send_response(conn->fd, "HTTP/1.1 400 Bad Request", "text/plain", "Client Disconnected");
-            return CONN_CLOSED;
+            cpu_relax();
+            if (strategy == WAIT_SPIN)
+                continue;
+            // the clock is only read every 64 polls
+            if (polls >= WAIT_SPIN_ITERS || ((polls & 63) == 0 && elapsed_ns(&start) >= WAIT_SPIN_US * 1000ULL))
+                break;
         }
-        conn->bytes_read += n;
+        wait_spin_ns += elapsed_ns(&start);
+    }
 
-        if (conn->bytes_read == BUFFER_SIZE || (conn->byte_offset + conn->bytes_read >= conn->file_size))
+    wait_blocked++;
+    if (WAIT_BATCH > 1 && !wait_idle)
+    {
+        struct __kernel_timespec ts = {.tv_sec = 0, .tv_nsec = WAIT_BATCH_US * 1000L};
+        if (submit_policy_wait(ring, WAIT_BATCH, &ts) == -ETIME)
         {
-            /*
-            if (conn->byte_offset + conn->bytes_read > conn->file_size)
-            {
-                conn->bytes_read = conn->file_size - conn->byte_offset;
-            }*/
-            conn->state = WAITING_FOR_AIO_WRITE;
-            if (libaio_func(conn, WRITE_FILE, global_aio_ctx, global_aio_event_fd) == CONN_ERROR)
-            {
-                perror("Error preparing write op in HANDLING_GET_IO");
-                return CONN_ERROR;
-            }
-            // conn->bytes_read = 0;                 // Reset for next recv
-            return CONN_ALIVE;
+            wait_timed_out++;
+            wait_idle = !io_uring_cq_ready(ring);
         }
-        return CONN_ALIVE;
+        return;
     }
+    wait_idle = 0;
+    submit_policy_wait(ring, 1, NULL);
+}
 
-    else
+void submit_policy_stats(unsigned long flushes[SUBMIT_REASONS], unsigned long *sqes, unsigned *batch)
+{
+    for (int i = 0; i < SUBMIT_REASONS; i++)
+        flushes[i] = sq_flushes[i];
+    *sqes = sq_submitted;
+    *batch = sq_batch;
+}
+
+// one line per STATS_INTERVAL_S from each ring loop, call once per iteration
+void ring_stats_tick(int worker)
+{
+    static __thread time_t next_report = 0;
+    if (STATS_INTERVAL_S <= 0)
+        return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    if (now.tv_sec < next_report)
+        return;
+    if (next_report != 0)
     {
-        fprintf(stderr, "Incorect state to complete request\n");
-        send_response(conn->fd, "HTTP/1.1 500 Internal Server Error", "text/plain", "Error completing the request.");
+        unsigned long flushes[SUBMIT_REASONS], sqes, total = 0;
+        unsigned batch;
+        submit_policy_stats(flushes, &sqes, &batch);
+        for (int i = 0; i < SUBMIT_REASONS; i++)
+            total += flushes[i];
+        printf("ring %d: %lu sqes in %lu submits (%.1f avg) size %lu latency %lu drain %lu, batch now %u\n",
+               worker, sqes, total, total ? (double)sqes / total : 0.0, flushes[SUBMIT_BY_SIZE],
+               flushes[SUBMIT_BY_LATENCY], flushes[SUBMIT_BY_DRAIN], batch);
+        printf("ring %d: wait %s, ready %lu spin-hit %lu blocked %lu batch-timeout %lu, spun %.1f ms\n",
+               worker, ring_wait_describe(), wait_ready, wait_spun, wait_blocked, wait_timed_out,
+               wait_spin_ns / 1e6);
+    }
+    next_report = now.tv_sec + STATS_INTERVAL_S;
+}
+
+static __thread int send_zc_enabled = 0;
+static __thread int linked_get_enabled = 0;
+
+int setup_linked_get(struct io_uring *ring)
+{
+    linked_get_enabled = (ring->features & IORING_FEAT_CQE_SKIP) != 0;
+    return linked_get_enabled ? CONN_ALIVE : CONN_ERROR;
+}
+
+int setup_send_zc(struct io_uring *ring)
+{
+    struct io_uring_probe *probe = io_uring_get_probe_ring(ring);
+    if (!probe)
+        return CONN_ERROR;
+    send_zc_enabled = io_uring_opcode_supported(probe, IORING_OP_SEND_ZC);
+    io_uring_free_probe(probe);
+    return send_zc_enabled ? CONN_ALIVE : CONN_ERROR;
+}
+
+// notification cqe of a send_zc, the kernel is done with that part of req_buffer
+int handle_send_zc_notif(struct io_uring *ring, conn_state *conn)
+{
+    conn->zc_notif_pending--;
+    if (conn->zc_notif_pending > 0)
+        return CONN_ALIVE;
+    if (conn->zc_closing)
         return CONN_CLOSED;
+    if (conn->zc_finish_pending)
+    {
+        conn->zc_finish_pending = 0;
+        return finish_request_uring(ring, conn);
+    }
+    if (conn->zc_refill_pending)
+    {
+        conn->zc_refill_pending = 0;
+        return queue_get_chunk(ring, conn);
     }
     return CONN_ALIVE;
 }
 
+// socket ops a stalled or trickling client could hold open forever
+static int is_client_op(async_func_enum func)
+{
+    return func == RECV_REQUEST || func == SEND_FILE || func == SEND_HEADER || func == SPLICE_SEND;
+}
+
+// bounds the socket op just prepared in sqe by conn->deadline, when it passes the kernel cancels
+// the op (-ECANCELED) and the timeout posts -ETIME, otherwise the timeout posts -ECANCELED.
+// both timeout cqes carry LINK_TIMEOUT_HANDLE and are dropped
+static void link_conn_timeout(struct io_uring *ring, struct io_uring_sqe *sqe, conn_state *conn)
+{
+    struct io_uring_sqe *timeout = io_uring_get_sqe(ring);
+    if (!timeout)
+        return; // io_uring_func left room for it, unreachable
+    conn_touch_deadline(conn);
+    sqe->flags |= IOSQE_IO_LINK;
+    io_uring_prep_link_timeout(timeout, &conn->deadline, IORING_TIMEOUT_ABS);
+    io_uring_sqe_set_data64(timeout, LINK_TIMEOUT_HANDLE);
+    increment_req_counter();
+}
+
 int io_uring_func(struct io_uring *ring, conn_state *conn, async_func_enum func)
 {
+    // polled file ops never take a socket ring slot
+    if (file_ring_enabled() && conn->file_direct && (func == READ_FILE || func == WRITE_FILE))
+        return queue_file_ring_op(conn, func);
+
+    // a linked chain (file op, socket op, timeout) must go out in the same submission,
+    // the socket half checks again when it recurses but then the room is already there
+    unsigned chain = (func == SPLICE_FILE || func == READ_SEND_FILE) ? 2 : 1;
+    if (USE_CONN_TIMEOUTS && (chain == 2 || is_client_op(func)))
+        chain++;
+    if (chain > 1 && io_uring_sq_space_left(ring) < chain)
+    {
+        io_uring_submit(ring);
+        reset_req_counter();
+    }
+
     struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
     if (!sqe)
     {
@@ -693,74 +2937,307 @@ int io_uring_func(struct io_uring *ring, conn_state *conn, async_func_enum func)
             reset_req_counter();
         }
     }
+    int fixed_file = conn->file_slot != -1;
+    int file = fixed_file ? conn->file_slot : conn->file_fd;
+    int fixed_buf = fixed_bufs_enabled && conn->buf_id != -1;
+
     switch (func)
     {
     case RECV_REQUEST:
-        io_uring_prep_recv(sqe, conn->fd, conn->req_buffer + conn->bytes_read, BUFFER_SIZE - conn->bytes_read, 0);
+        if (!conn->req_buffer && buf_ring_enabled())
+        {
+            // idle conn holds no buffer, kernel picks one from the ring when data arrives
+            io_uring_prep_recv(sqe, conn->fd, NULL, BUFFER_SIZE, 0);
+            sqe->flags |= IOSQE_BUFFER_SELECT;
+            sqe->buf_group = BUF_RING_GROUP_ID;
+        }
+        else
+        {
+            // a PUT body never reads into the next pipelined request
+            size_t len = BUFFER_SIZE - conn->bytes_read;
+            if (conn->state == HANDLING_POST && conn->file_size - conn->byte_offset - conn->bytes_read < len)
+                len = conn->file_size - conn->byte_offset - conn->bytes_read;
+            io_uring_prep_recv(sqe, conn->fd, conn->req_buffer + conn->bytes_read, len, 0);
+        }
         break;
     case WRITE_FILE:
-        io_uring_prep_write(sqe, conn->file_fd, conn->req_buffer, BUFFER_SIZE, conn->byte_offset);
+        if (fixed_buf)
+            io_uring_prep_write_fixed(sqe, file, conn->req_buffer, BUFFER_SIZE, conn->byte_offset, conn->buf_id);
+        else
+            io_uring_prep_write(sqe, file, conn->req_buffer, BUFFER_SIZE, conn->byte_offset);
+        if (fixed_file)
+            sqe->flags |= IOSQE_FIXED_FILE;
         break;
     case READ_FILE:
-        io_uring_prep_read(sqe, conn->file_fd, conn->req_buffer, BUFFER_SIZE, conn->byte_offset);
+        if (fixed_buf)
+            io_uring_prep_read_fixed(sqe, file, conn->req_buffer, BUFFER_SIZE, conn->byte_offset, conn->buf_id);
+        else
+            io_uring_prep_read(sqe, file, conn->req_buffer, BUFFER_SIZE, conn->byte_offset);
+        if (fixed_file)
+            sqe->flags |= IOSQE_FIXED_FILE;
         break;
     case SEND_FILE:
-        io_uring_prep_send(sqe, conn->fd, conn->req_buffer + conn->util_offset, BUFFER_SIZE - conn->util_offset, 0);
+        if (conn->header_sent < conn->header_len)
+        {
+            // first chunk of a GET, header and body leave in the same segment
+            conn->send_iov[0].iov_base = conn->header + conn->header_sent;
+            conn->send_iov[0].iov_len = conn->header_len - conn->header_sent;
+            conn->send_iov[1].iov_base = conn->req_buffer + conn->util_offset;
+            conn->send_iov[1].iov_len = conn->bytes_read - conn->util_offset;
+            memset(&conn->send_msg, 0, sizeof(conn->send_msg));
+            conn->send_msg.msg_iov = conn->send_iov;
+            conn->send_msg.msg_iovlen = 2;
+            io_uring_prep_sendmsg(sqe, conn->fd, &conn->send_msg, 0);
+        }
+        else if (send_zc_enabled && fixed_buf)
+            io_uring_prep_send_zc_fixed(sqe, conn->fd, conn->req_buffer + conn->util_offset,
+                                        conn->bytes_read - conn->util_offset, 0, 0, conn->buf_id);
+        else if (send_zc_enabled)
+            io_uring_prep_send_zc(sqe, conn->fd, conn->req_buffer + conn->util_offset,
+                                  conn->bytes_read - conn->util_offset, 0, 0);
+        else
+            io_uring_prep_send(sqe, conn->fd, conn->req_buffer + conn->util_offset, conn->bytes_read - conn->util_offset, 0);
+        break;
+    case SPLICE_FILE:
+    {
+        size_t chunk = conn->file_size - conn->byte_offset;
+        if (chunk > BUFFER_SIZE)
+            chunk = BUFFER_SIZE;
+        conn->pipe_pending = chunk;
+        io_uring_prep_splice(sqe, file, conn->byte_offset, conn->pipe_fds[1], -1, chunk, SPLICE_F_MOVE);
+        if (fixed_file)
+            sqe->splice_flags |= SPLICE_F_FD_IN_FIXED;
+        sqe->flags |= IOSQE_IO_LINK;
+        io_uring_sqe_set_data64(sqe, conn_handle(conn));
+        increment_req_counter();
+        return io_uring_func(ring, conn, SPLICE_SEND);
+    }
+    case READ_SEND_FILE:
+        if (fixed_buf)
+            io_uring_prep_read_fixed(sqe, file, conn->req_buffer, BUFFER_SIZE, conn->byte_offset, conn->buf_id);
+        else
+            io_uring_prep_read(sqe, file, conn->req_buffer, BUFFER_SIZE, conn->byte_offset);
+        if (fixed_file)
+            sqe->flags |= IOSQE_FIXED_FILE;
+        // a short or failed read posts its cqe and cancels the send
+        sqe->flags |= IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+        io_uring_sqe_set_data64(sqe, conn_handle(conn) | LINKED_READ_TAG);
+        increment_req_counter();
+        return io_uring_func(ring, conn, SEND_FILE);
+    case SPLICE_SEND:
+        io_uring_prep_splice(sqe, conn->pipe_fds[0], -1, conn->fd, -1, conn->pipe_pending, SPLICE_F_MOVE);
+        break;
+    case OPEN_FILE:
+        // opened buffered, the io policy decides on O_DIRECT once statx has the size
+        io_uring_prep_openat(sqe, AT_FDCWD, conn->open_req->path, O_RDONLY | O_NONBLOCK, 0);
+        break;
+    case STATX_FILE:
+        io_uring_prep_statx(sqe, conn->file_fd, "", AT_EMPTY_PATH, STATX_SIZE | STATX_INO | STATX_MTIME,
+                            &conn->open_req->stx);
+        break;
+    case SEND_HEADER:
+        // MSG_MORE holds a header in front of a splice body until the first pipe send pushes both
+        io_uring_prep_send(sqe, conn->fd, conn->header + conn->header_sent, conn->header_len - conn->header_sent,
+                           conn->file_size > 0 ? MSG_MORE : 0);
         break;
     default:
         fprintf(stderr, "Invalid uring call: %s\n", strerror(errno));
         return CONN_ERROR;
     }
-    io_uring_sqe_set_data(sqe, conn);
+    io_uring_sqe_set_data64(sqe, conn_handle(conn));
     increment_req_counter();
+    if (USE_CONN_TIMEOUTS && is_client_op(func))
+        link_conn_timeout(ring, sqe, conn);
     return CONN_ALIVE;
 }
 
-int handle_requests_uring(struct io_uring *ring, conn_state *conn, ssize_t res)
+int queue_get_chunk(struct io_uring *ring, conn_state *conn)
+{
+    size_t cached = block_cache_read(conn, conn->req_buffer);
+    if (cached > 0)
+    {
+        // no disk read, the chunk goes straight to the send
+        conn->bytes_read = cached;
+        conn->util_offset = 0;
+        conn->byte_offset += cached;
+        conn->last_op = OP_WRITE;
+        return io_uring_func(ring, conn, SEND_FILE);
+    }
+
+    // only full chunks are linked, the O_DIRECT tail read comes back short and would break the link
+    // a link can't span the socket and the file ring
+    if (linked_get_enabled && !(file_ring_enabled() && conn->file_direct) && conn->file_size - conn->byte_offset >= BUFFER_SIZE)
+    {
+        conn->bytes_read = BUFFER_SIZE;
+        conn->util_offset = 0;
+        conn->last_op = OP_WRITE; // only the send posts a cqe
+        int ret = io_uring_func(ring, conn, READ_SEND_FILE);
+        conn->byte_offset += BUFFER_SIZE;
+        return ret;
+    }
+    conn->last_op = OP_READ;
+    return io_uring_func(ring, conn, READ_FILE);
+}
+
+// response fully sent, either close or start on the next request of a keep-alive conn
+int finish_request_uring(struct io_uring *ring, conn_state *conn)
+{
+    if (!conn->keep_alive)
+        return CONN_CLOSED;
+    if (conn->zc_notif_pending > 0)
+    {
+        // req_buffer is still pinned by send_zc, reset once it is released
+        conn->zc_finish_pending = 1;
+        return CONN_ALIVE;
+    }
+    reset_conn(conn);
+    if (conn->bytes_read > 0)
+        return handle_requests_uring(ring, conn, 0); // pipelined request already buffered
+    return io_uring_func(ring, conn, RECV_REQUEST);
+}
+
+// file -> pipe -> socket body, the header has already gone out
+static int start_splice_body(struct io_uring *ring, conn_state *conn)
+{
+    if (conn->pipe_fds[0] == -1 && pipe2(conn->pipe_fds, O_CLOEXEC) == -1)
+    {
+        perror("Failed to create splice pipe");
+        return CONN_ERROR;
+    }
+    // body never passes through user space, give the buffer back unless it holds the next request
+    if (conn->buf_id != -1 && conn->carry_len == 0)
+        recycle_provided_buf(conn);
+    conn->byte_offset = 0;
+    conn->state = HANDLING_SPLICE;
+    conn->last_op = OP_READ;
+    return io_uring_func(ring, conn, SPLICE_FILE);
+}
+
+// the file is open and sized. the 200 header rides along with the first body chunk in one sendmsg,
+// only an empty file or a splice body sends it on its own
+static int start_get_response(struct io_uring *ring, conn_state *conn, const char *header, size_t header_len)
+{
+    register_conn_file(conn);
+    block_cache_bind(conn);
+    memcpy(conn->header, header, header_len);
+    conn->header_len = header_len;
+    conn->header_sent = 0;
+    conn->byte_offset = 0;
+    conn->bytes_read = 0;
+    conn->util_offset = 0;
+
+    conn->file_direct = conn->file_entry ? conn->file_entry->direct_io
+                                         : (fcntl(conn->file_fd, F_GETFL) & O_DIRECT) != 0;
+
+    // splice can't move pages of an O_DIRECT file, those keep the read/send path
+    if (conn->file_size == 0 || (USE_SPLICE_GET && !conn->file_ino && !conn->file_direct))
+    {
+        conn->state = SENDING_HEADER;
+        conn->last_op = OP_WRITE;
+        return io_uring_func(ring, conn, SEND_HEADER);
+    }
+
+    conn->state = HANDLING_GET; // req_buffer becomes the send buffer, reads overwrite it
+    return queue_get_chunk(ring, conn);
+}
+
+// uring side of handle_get_header(), an fd cache hit sends the header right away,
+// a miss goes through OPEN_FILE and STATX_FILE so the loop never waits on a path lookup
+static int start_get_file(struct io_uring *ring, conn_state *conn, const http_request *req)
+{
+    char full_path[2048];
+    get_full_path(req, full_path, sizeof(full_path));
+    unsigned heat = record_file_heat(full_path);
+
+    if (USE_FD_CACHE && (conn->file_entry = fd_cache_get(full_path, 0)))
+    {
+        conn->file_fd = conn->file_entry->fd;
+        conn->file_size = conn->file_entry->size;
+        return start_get_response(ring, conn, conn->file_entry->header, conn->file_entry->header_len);
+    }
+
+    conn->open_req = malloc(sizeof(open_request));
+    if (!conn->open_req)
+    {
+        perror("Failed to allocate open request");
+        return CONN_ERROR;
+    }
+    memcpy(conn->open_req->path, full_path, sizeof(full_path));
+    conn->open_req->heat = heat;
+    conn->state = OPENING_FILE;
+    conn->last_op = OP_READ;
+    return io_uring_func(ring, conn, OPEN_FILE);
+}
+
+// statx came back, finish what handle_get_header() does after its fstat()
+static int finish_get_file(struct io_uring *ring, conn_state *conn)
 {
-    char method[16], path[1024];
+    open_request *open_req = conn->open_req;
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_size = open_req->stx.stx_size;
+    st.st_ino = open_req->stx.stx_ino;
+    st.st_mtim.tv_sec = open_req->stx.stx_mtime.tv_sec;
+    st.st_mtim.tv_nsec = open_req->stx.stx_mtime.tv_nsec;
+    conn->file_size = st.st_size;
+    int direct_io = apply_io_policy(conn->file_fd, O_RDONLY | O_NONBLOCK, st.st_size, open_req->heat);
 
+    const char *mime_type = get_mime_type(open_req->path);
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %ld\r\n\r\n",
+                              mime_type, conn->file_size);
+    if (USE_FD_CACHE)
+        conn->file_entry = fd_cache_put(open_req->path, conn->file_fd, &st, direct_io, mime_type, header, header_len);
+    free(open_req);
+    conn->open_req = NULL;
+    return start_get_response(ring, conn, header, header_len);
+}
+
+int handle_requests_uring(struct io_uring *ring, conn_state *conn, ssize_t res)
+{
     if (conn->state == READING_HEADER)
     {
         conn->bytes_read += res;
         // if we have full header request
-        if (strstr(conn->req_buffer, "\r\n\r\n"))
+        parse_status status = parse_request(&conn->parser, conn->req_buffer, conn->bytes_read);
+        if (status == PARSE_BAD)
         {
-            sscanf(conn->req_buffer, "%s %s", method, path);
-            // printf("Received request:\n%s %s\n", method, path);
+            send_static_response(conn->fd, RESP_MALFORMED);
+            return CONN_CLOSED;
+        }
+        if (status == PARSE_DONE)
+        {
+            const http_request *req = &conn->parser.req;
+            size_t header_len = req->header_len;
+            conn->keep_alive = wants_keep_alive(req);
+            // printf("Received request:\n%.*s %.*s\n", (int)req->method.len, req->method.ptr, (int)req->path.len, req->path.ptr);
 
-            if (strcmp(method, "GET") == 0)
+            if (slice_eq(req->method, "GET"))
             {
-                int ret = handle_get_header(conn->fd, path, &conn->file_fd,
-                                            &conn->file_size, NON_BLOCKING);
+                if (stash_pipelined(conn, header_len) == CONN_ERROR)
+                    return CONN_ERROR;
+                size_t spill_len;
+                int ret = send_cached_response(conn->fd, req, conn->req_buffer, &spill_len, NON_BLOCKING, 0);
                 if (ret == CONN_ERROR)
-                {
-                    fprintf(stderr, "error completing get_header: %s\n", strerror(errno));
                     return CONN_ERROR;
-                }
-                else if (ret == CONN_CLOSED)
+                if (ret == CONN_ALIVE)
                 {
-                    fprintf(stderr, "issue in client's req GET\n");
-                    return CONN_CLOSED;
+                    if (spill_len == 0)
+                        return finish_request_uring(ring, conn);
+                    // socket buffer full, the rest goes out of req_buffer as a normal GET send
+                    conn->bytes_read = spill_len;
+                    conn->util_offset = 0;
+                    conn->byte_offset = conn->file_size = 0;
+                    conn->state = HANDLING_GET;
+                    conn->last_op = OP_WRITE;
+                    return io_uring_func(ring, conn, SEND_FILE);
                 }
-
-                memset(conn->req_buffer, 0, BUFFER_SIZE); // use the req_buffer as send buffer
-                conn->byte_offset = 0;
-                conn->bytes_read = 0;
-                conn->state = HANDLING_GET;
-                conn->last_op = OP_READ;
-                io_uring_func(ring, conn, READ_FILE);
+                return start_get_file(ring, conn, req);
             }
-            else if (strcmp(method, "PUT") == 0)
+            else if (slice_eq(req->method, "PUT"))
             {
-                char *body_start = strstr(conn->req_buffer, "\r\n\r\n");
-                if (!body_start)
-                {
-                    fprintf(stderr, "Malformed headers in client req PUT\n");
-                    send_response(conn->fd, "HTTP/1.1 400 Bad Request", "text/plain", "Malformed headers.");
-                    return CONN_CLOSED;
-                }
-                int ret = handle_put_header(conn->fd, path, &conn->file_fd, &conn->file_size, conn->req_bufferm, NON_BLOCKING);
+                int ret = handle_put_header(conn->fd, req, &conn->file_fd, &conn->file_size, NON_BLOCKING);
                 if (ret == CONN_ERROR)
                 {
                     fprintf(stderr, "error completing put_header: %s\n", strerror(errno));
@@ -771,13 +3248,15 @@ int handle_requests_uring(struct io_uring *ring, conn_state *conn, ssize_t res)
                     fprintf(stderr, "issue in client's req PUT\n");
                     return CONN_CLOSED;
                 }
-                body_start += 4; // Skip past the "\r\n\r\n"
-                size_t initial_body_len = (size_t)res - (body_start - conn->req_buffer);
-                if (initial_body_len < 0)
-                    initial_body_len = 0;
+                register_conn_file(conn);
+                conn->file_direct = file_ring_enabled() && (fcntl(conn->file_fd, F_GETFL) & O_DIRECT);
+                // bytes past the body belong to pipelined requests
+                if (stash_pipelined(conn, header_len + conn->file_size) == CONN_ERROR)
+                    return CONN_ERROR;
+                size_t initial_body_len = conn->bytes_read - header_len;
                 if (initial_body_len > 0)
                 {
-                    memmove(conn->req_buffer, body_start, initial_body_len);
+                    memmove(conn->req_buffer, conn->req_buffer + header_len, initial_body_len);
                     memset(conn->req_buffer + initial_body_len, 0, BUFFER_SIZE - initial_body_len);
                     if (initial_body_len >= conn->file_size)
                     {
@@ -797,10 +3276,21 @@ int handle_requests_uring(struct io_uring *ring, conn_state *conn, ssize_t res)
             else
             {
                 fprintf(stderr, "Method Not Allowed.\n");
-                send_response(conn->fd, "HTTP/1.1 405 Method Not Allowed", "text/plain", "Method Not Allowed.");
+                send_static_response(conn->fd, RESP_METHOD_NOT_ALLOWED);
                 return CONN_CLOSED;
             }
         }
+        else if (conn->bytes_read >= BUFFER_SIZE)
+        {
+            send_static_response(conn->fd, RESP_HEADER_TOO_LARGE);
+            return CONN_CLOSED;
+        }
+        else
+        {
+            // header split across recvs, keep reading into the same buffer
+            conn->last_op = OP_READ;
+            return io_uring_func(ring, conn, RECV_REQUEST);
+        }
         return CONN_ALIVE;
     }
     else if (conn->state == HANDLING_GET)
@@ -818,21 +3308,99 @@ int handle_requests_uring(struct io_uring *ring, conn_state *conn, ssize_t res)
         }
         else if (conn->last_op == OP_WRITE)
         {
+            if (conn->header_sent < conn->header_len)
+            {
+                // the coalesced sendmsg counts header bytes first
+                size_t header_left = conn->header_len - conn->header_sent;
+                size_t done = (size_t)res < header_left ? (size_t)res : header_left;
+                conn->header_sent += done;
+                res -= done;
+            }
             conn->util_offset += res;
 
-            if (conn->util_offset < conn->bytes_read)
+            if (conn->header_sent < conn->header_len || conn->util_offset < conn->bytes_read)
             {
                 io_uring_func(ring, conn, SEND_FILE);
                 return CONN_ALIVE;
             }
+            block_cache_store(conn, conn->byte_offset - conn->bytes_read, conn->req_buffer, conn->bytes_read);
+            if (USE_RESP_CACHE && conn->file_entry && conn->bytes_read == conn->file_size)
+            {
+                // whole small file came in one chunk, the next GET for it skips the disk entirely
+                file_cache_entry *entry = conn->file_entry;
+                resp_cache_insert(entry->path, conn->req_buffer, entry->size, entry->ino, entry->mtime,
+                                  entry->header, entry->header_len);
+            }
             if (conn->byte_offset >= conn->file_size)
             {
-                printf("FILE SENT SUCCESSFULLY\n");
-                return CONN_CLOSED;
+                // printf("FILE SENT SUCCESSFULLY\n");
+                return finish_request_uring(ring, conn);
             }
             conn->util_offset = 0;
+            if (conn->zc_notif_pending > 0)
+            {
+                // kernel may still be reading req_buffer, refill after the notification
+                conn->zc_refill_pending = 1;
+                return CONN_ALIVE;
+            }
+            queue_get_chunk(ring, conn);
+        }
+        else
+        {
+            fprintf(stderr, "incorrect last_op\n");
+            return CONN_ERROR;
+        }
+    }
+    else if (conn->state == OPENING_FILE)
+    {
+        if (res < 0)
+        {
+            fprintf(stderr, "File not found: %s\n", strerror(-res));
+            send_static_response(conn->fd, RESP_NOT_FOUND);
+            return CONN_CLOSED;
+        }
+        conn->file_fd = res;
+        conn->state = STATING_FILE;
+        return io_uring_func(ring, conn, STATX_FILE);
+    }
+    else if (conn->state == STATING_FILE)
+    {
+        if (res < 0)
+        {
+            fprintf(stderr, "Couldnt get file size: %s\n", strerror(-res));
+            send_static_response(conn->fd, RESP_FILE_SIZE_ERROR);
+            return CONN_CLOSED;
+        }
+        return finish_get_file(ring, conn);
+    }
+    else if (conn->state == SENDING_HEADER)
+    {
+        conn->header_sent += res;
+        if (conn->header_sent < conn->header_len)
+            return io_uring_func(ring, conn, SEND_HEADER);
+        if (conn->file_size == 0)
+            return finish_request_uring(ring, conn);
+        return start_splice_body(ring, conn);
+    }
+    else if (conn->state == HANDLING_SPLICE)
+    {
+        if (conn->last_op == OP_READ)
+        {
+            // file -> pipe done, its linked pipe -> socket cqe comes next
+            conn->byte_offset += res;
+            conn->pipe_pending = res;
+            conn->last_op = OP_WRITE;
+            return CONN_ALIVE;
+        }
+        else if (conn->last_op == OP_WRITE)
+        {
+            conn->pipe_pending -= res;
+            if (conn->pipe_pending > 0)
+                return io_uring_func(ring, conn, SPLICE_SEND); // short send, drain the pipe first
+            if (conn->byte_offset >= conn->file_size)
+                return finish_request_uring(ring, conn);
             conn->last_op = OP_READ;
-            io_uring_func(ring, conn, READ_FILE);
+            return io_uring_func(ring, conn, SPLICE_FILE);
         }
         else
         {
@@ -867,8 +3435,8 @@ int handle_requests_uring(struct io_uring *ring, conn_state *conn, ssize_t res)
             conn->bytes_read = 0; // to indicate read block you've written everything from buffer
             if (conn->byte_offset >= conn->file_size)
             {
-                send_response(conn->fd, "HTTP/1.1 201 Created", "text/plain", "File uploaded.");
-                return CONN_CLOSED;
+                send_static_response(conn->fd, RESP_CREATED);
+                return finish_request_uring(ring, conn);
             }
 
             // keep recving if bytes not complete
@@ -884,7 +3452,7 @@ int handle_requests_uring(struct io_uring *ring, conn_state *conn, ssize_t res)
     else
     {
         fprintf(stderr, "Incorect state to complete request\n");
-        send_response(conn->fd, "HTTP/1.1 500 Internal Server Error", "text/plain", "Error completing the request.");
+        send_static_response(conn->fd, RESP_REQUEST_ERROR);
         return CONN_CLOSED;
     }
 
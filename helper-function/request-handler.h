@@ -18,6 +18,10 @@
 #include <fcntl.h>    // for file control options
 #include <sys/stat.h> // to get file stats
 #include <sys/mman.h> // for memory alignment
+#include <sys/sendfile.h> // for in kernel file to socket copy
+#include <time.h>         // for cache validation clock
+#include <pthread.h>      // for the shared buffer pool lock
+#include <sys/resource.h> // for sizing the conn table from the fd limit
 
 #include <libaio.h>      // for libaio
 #include <sys/eventfd.h> // For eventfd
@@ -28,13 +32,120 @@
 #define MAX_PENDING_ACCEPTS 2048
 #define BATCH_SIZE 1024
 
-#define BUFFER_SIZE 64 * 1024 // 64kb or 16 blocks on (hardware)
+#define BUFFER_SIZE (64 * 1024) // 64kb or 16 blocks on (hardware)
 #define MY_BLOCK_SIZE 4096
 #define ROOT "/var/www/html"
 
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#ifndef IO_POOL_PREFAULT
+#define IO_POOL_PREFAULT 256 // io buffers mapped and faulted in at startup (16mb), the pool grows a huge page at a time after
+#endif
+#ifndef USE_MLOCK_POOL
+#define USE_MLOCK_POOL 0 // 1 = mlock prefaulted io buffer memory, needs a big enough RLIMIT_MEMLOCK
+#endif
+
+#define BUF_RING_GROUP_ID 1
+#define BUF_RING_ENTRIES 1024 // power of 2, bounds uring recv memory to in-flight requests (64mb)
+#define FIXED_FILE_SLOTS 8192 // sparse registered file table size
+
+#define FD_CACHE_SLOTS 4096 // power of 2, direct mapped per thread, a colliding path evicts the old entry
+#define FD_CACHE_TTL_S 1    // cached GET files are re-stat'd at most this often
+
+#define RESP_CACHE_BUCKETS 4096             // power of 2, per thread hash buckets (and ghost slots)
+#ifndef RESP_CACHE_BUDGET
+#define RESP_CACHE_BUDGET (32 * 1024 * 1024) // bytes of cached responses for the whole server, split across workers
+#endif
+#define RESP_CACHE_MAX_FILE (16 * 1024)     // larger files are always streamed
+#define RESP_CACHE_TTL_S 1                  // cached responses are re-stat'd at most this often
+
+#ifndef BLOCK_CACHE_BUDGET
+#define BLOCK_CACHE_BUDGET (256 * 1024 * 1024) // bytes of cached O_DIRECT chunks for the whole server, split across workers
+#endif
+
+#define LINKED_READ_TAG 1UL // low user_data bit marking the read half of a linked GET chain
+
+#ifndef GET_IO_MODE
+#define GET_IO_MODE IO_MODE_AUTO // IO_MODE_BUFFERED is required for the splice path, HTTP_IO_MODE env overrides
+#endif
+#define DIRECT_IO_MIN_SIZE (1024 * 1024) // auto mode: smaller files stay buffered
+#define IO_HOT_HITS 8                    // auto mode: big files requested this often stay buffered too
+#define IO_HEAT_SLOTS 4096               // power of 2, per thread access counters
+#define IO_HEAT_DECAY 16384              // counters halve after this many GETs
+#ifndef USE_SENDFILE_GET
+#define USE_SENDFILE_GET 1 // 1 = blocking servers serve GET with sendfile(), 0 = pread + send loop
+#endif
+#ifndef USE_FD_CACHE
+#define USE_FD_CACHE 1 // 1 = GET reuses open fds, size, MIME type and response header across requests
+#endif
+#ifndef USE_RESP_CACHE
+#define USE_RESP_CACHE 1 // 1 = small GET files are answered from an in-memory copy of the whole response
+#endif
+#ifndef USE_BLOCK_CACHE
+#define USE_BLOCK_CACHE 1 // 1 = O_DIRECT GET chunks are kept in a user-space cache and reads check it first
+#endif
+#ifndef USE_SPLICE_GET
+#define USE_SPLICE_GET 0 // 1 = uring GET moves file pages to the socket via file -> pipe -> socket splice
+#endif
+
 #define CONN_CLOSED 1
 #define CONN_ERROR -1
 #define CONN_ALIVE 0
+#define CACHE_MISS 2 // send_cached_response had nothing, serve the GET normally
+
+#define STATIC_RESP_MAX 160 // room for each pre-rendered status response
+
+#ifndef CONN_TABLE_SLOTS
+#define CONN_TABLE_SLOTS 0 // per thread connection slots, 0 = the RLIMIT_NOFILE soft limit (every conn holds an fd)
+#endif
+#define CONN_TABLE_MAX_SLOTS (1 << 20) // cap of the RLIMIT_NOFILE sizing, slots are reserved address space until used
+#define ACCEPT_HANDLE 2UL // uring user_data of the multishot accept, generation 0 is never a conn
+
+#define KEEP_ALIVE_TIMEOUT_S 5 // an idle keep-alive conn is dropped after this
+#ifndef USE_CONN_TIMEOUTS
+#define USE_CONN_TIMEOUTS 1 // 1 = uring socket ops carry linked timeouts, event-driven conns sit on a timer wheel,
+                            // blocking recvs get the time left to an absolute deadline
+#endif
+#ifndef HEADER_TIMEOUT_S
+#define HEADER_TIMEOUT_S 10 // the whole request header must arrive within this
+#endif
+#ifndef BODY_TIMEOUT_S
+#define BODY_TIMEOUT_S 30 // every async body recv or send must make progress within this, a blocking PUT body must arrive within it
+#endif
+#ifndef SUBMIT_BATCH_MIN
+#define SUBMIT_BATCH_MIN 8 // power of 2, smallest adaptive SQE batch
+#endif
+#ifndef SUBMIT_BATCH_MAX
+#define SUBMIT_BATCH_MAX 256 // power of 2, largest adaptive SQE batch
+#endif
+#ifndef SUBMIT_LATENCY_US
+#define SUBMIT_LATENCY_US 50 // a queued SQE waits at most this long for its batch to fill
+#endif
+#ifndef TASKRUN_MODE
+#define TASKRUN_MODE TASKRUN_DEFER // uring task work, HTTP_TASKRUN=default|coop|defer env overrides
+#endif
+#ifndef CQ_RING_FACTOR
+#define CQ_RING_FACTOR 4 // CQ entries per SQ entry, multishot, send_zc and link timeouts post extra CQEs
+#endif
+#ifndef WAIT_STRATEGY
+#define WAIT_STRATEGY WAIT_HYBRID // uring CQ waiting, HTTP_WAIT=spin|block|hybrid env overrides
+#endif
+#ifndef WAIT_SPIN_US
+#define WAIT_SPIN_US 50 // hybrid: poll the CQ this long before blocking...
+#endif
+#ifndef WAIT_SPIN_ITERS
+#define WAIT_SPIN_ITERS 100000 // ...or this many times, whichever ends first
+#endif
+#ifndef WAIT_BATCH
+#define WAIT_BATCH 1 // > 1 = a blocking wait holds out for this many CQEs...
+#endif
+#define WAIT_BATCH_US 100 // ...for at most this long, then sleeps untimed once it comes back empty
+#ifndef STATS_INTERVAL_S
+#define STATS_INTERVAL_S 0 // > 0 = uring loops print their submit and wait stats this often
+#endif
+#define FILE_RING_DEPTH 1024 // SQ entries of the IOPOLL file ring and its poller's MSG_RING ring
+#define LINK_TIMEOUT_HANDLE 4UL // uring user_data of linked timeouts, generation 0 is never a conn
+#define TIMER_TICK_MS 250       // timer wheel resolution, also the epoll_wait timeout
+#define TIMER_WHEEL_SLOTS 64    // per level, power of 2, two levels span ~17 minutes
 
 _Static_assert(BUFFER_SIZE % MY_BLOCK_SIZE == 0,
                "BUFFER_SIZE must be multiple of BLOCK_SIZE");
@@ -45,6 +156,60 @@ typedef enum
     NON_BLOCKING
 } server_type;
 
+typedef enum
+{
+    IO_MODE_AUTO,     // per file, by size and access frequency
+    IO_MODE_BUFFERED, // page cache for everything
+    IO_MODE_DIRECT    // O_DIRECT for everything
+} io_mode;
+
+// when the kernel runs the task work that posts uring completions
+typedef enum
+{
+    TASKRUN_DEFAULT, // right away, interrupting the loop with an IPI if it is in user space
+    TASKRUN_COOP,    // next time the loop enters the kernel anyway
+    TASKRUN_DEFER    // only when the loop waits for completions, single issuer rings
+} taskrun_mode;
+
+// how the uring loop waits for completions
+typedef enum
+{
+    WAIT_SPIN,  // poll the CQ forever, lowest wake-up latency, burns the core at idle
+    WAIT_BLOCK, // sleep in io_uring_enter right away
+    WAIT_HYBRID // poll WAIT_SPIN_US / WAIT_SPIN_ITERS, then sleep
+} wait_strategy;
+
+// why the uring loop handed its queued SQEs to the kernel
+typedef enum
+{
+    SUBMIT_BY_SIZE,    // batch threshold reached
+    SUBMIT_BY_LATENCY, // oldest SQE waited SUBMIT_LATENCY_US
+    SUBMIT_BY_DRAIN,   // no completions left to batch with
+    SUBMIT_REASONS
+} submit_reason;
+
+// canned replies, rendered once by init_static_responses()
+typedef enum
+{
+    RESP_FILE_SENT,
+    RESP_CREATED,
+    RESP_MALFORMED,
+    RESP_BAD_CONTENT_LENGTH,
+    RESP_CLIENT_DISCONNECTED,
+    RESP_HEADER_TOO_LARGE,
+    RESP_BAD_UPLOAD_PATH,
+    RESP_NOT_FOUND,
+    RESP_METHOD_NOT_ALLOWED,
+    RESP_LENGTH_REQUIRED,
+    RESP_INTERNAL_ERROR,
+    RESP_FILE_SIZE_ERROR,
+    RESP_REQUEST_ERROR,
+    RESP_FILE_IO_ERROR,
+    RESP_FILE_WRITE_ERROR,
+    RESP_REQUEST_TIMEOUT,
+    STATIC_RESP_COUNT
+} static_response;
+
 // typedef enum
 // {
 //     ACCEPTING_CONNECTION,
@@ -55,8 +220,17 @@ typedef enum
 
 typedef enum
 {
+    ACCEPTING_CONNECTION, // uring accept SQE in flight
     READING_HEADER,
 
+    // uring request handling (direction given by last_op)
+    HANDLING_GET,
+    HANDLING_POST,
+    HANDLING_SPLICE, // GET body via linked file -> pipe -> socket splices
+    OPENING_FILE,    // uring GET openat in flight
+    STATING_FILE,    // uring GET statx in flight
+    SENDING_HEADER,  // uring GET header sent on its own (empty file or splice body)
+
     // network IO
     HANDLING_GET_IO,  // waiting for more data from client (RECEIVING_PUT_DATA)
     HANDLING_POST_IO, // data ready in buffer, sending to client (SENDING_GET_DATA)
@@ -77,37 +251,197 @@ typedef enum
     RECV_REQUEST,
     WRITE_FILE,
     READ_FILE,
-    SEND_FILE
+    SEND_FILE,
+    SPLICE_FILE,   // file -> pipe, linked with SPLICE_SEND
+    SPLICE_SEND,   // pipe -> socket
+    READ_SEND_FILE, // READ_FILE linked with SEND_FILE, read cqe skipped on success
+    OPEN_FILE,      // openat of open_req->path
+    STATX_FILE,     // statx of file_fd into open_req->stx
+    SEND_HEADER     // plain send of the rest of conn->header
 } async_func_enum;
 
+// view into req_buffer, not NUL terminated
 typedef struct
 {
-    int fd;                         // fd of client
-    char *req_buffer;               // aligned buffer
-    size_t bytes_read;              // of the request
-    off_t file_size;                // total file size
-    int file_fd;                    // fd of file to send or of being written
-    off_t byte_offset;              // offset in file (read or write)
-    size_t util_offset;             // for network offset
-    size_t header_buffer_processed; // to track request read/sent bytes
+    const char *ptr;
+    size_t len;
+} http_slice;
+
+typedef struct
+{
+    http_slice method, path, version;
+    http_slice content_length, connection, range, host, if_none_match; // len 0 when absent
+    size_t header_len; // request line + headers + blank line
+} http_request;
+
+typedef enum
+{
+    PARSE_INCOMPLETE, // need more bytes
+    PARSE_DONE,       // header complete, req filled in
+    PARSE_BAD         // malformed request line or header
+} parse_status;
+
+// resumable header parser, each recv only scans the new bytes
+typedef struct
+{
+    size_t line_start; // first byte of the line not parsed yet
+    size_t scan_pos;   // LF search resumes here
+    http_request req;
+} http_parser;
+
+// open GET file shared by every conn serving it, freed once the last ref goes
+typedef struct file_cache_entry
+{
+    char *path;
+    int fd;
+    off_t size;
+    ino_t ino;
+    struct timespec mtime;
+    int direct_io;        // fd has O_DIRECT
+    time_t checked_at;    // last stat() validation
+    const char *mime_type;
+    char header[256];     // pre-rendered 200 response header
+    size_t header_len;
+    unsigned refs;        // cache slot + in-flight conns
+    int file_slot;        // registered file index, held until the entry is freed, -1 if none
+} file_cache_entry;
+
+// GET file lookup in flight on the ring, lives from OPEN_FILE until the statx completes
+typedef struct
+{
+    char path[2048];
+    unsigned heat; // record_file_heat() of path, feeds the io policy once the size is known
+    struct statx stx;
+} open_request;
+
+#define CACHE_LINE 64
+
+// laid out by access frequency: the first line is read on every completion, the second once or
+// twice per request, the rest only by the parser, header send or aio paths
+typedef struct
+{
+    // hot
+    int fd;                 // fd of client
     conn_state_enum state;
+    operation_type last_op; // last uring op submitted for this conn
+    int file_fd;            // fd of file to send or of being written
+    int file_slot;          // registered file index of file_fd, -1 if not registered (may be file_entry's)
+    int buf_id;             // provided buffer backing req_buffer, -1 if req_buffer is from the io buffer pool
+    char *req_buffer;       // aligned buffer
+    size_t bytes_read;      // of the request
+    off_t file_size;        // total file size
+    off_t byte_offset;      // offset in file (read or write)
+    size_t util_offset;     // for network offset
+
+    // warm
+    _Alignas(CACHE_LINE) file_cache_entry *file_entry; // set when file_fd is a shared fd cache entry, never close it directly
+    ino_t file_ino;                 // block cache key of file_fd, 0 when its chunks aren't cached
+    int file_direct;                // file_fd has O_DIRECT, uring reads and writes may use the file ring
+    int64_t file_mtime_ns;
+    unsigned zc_notif_pending;      // send_zc notifications still owed, req_buffer is pinned until 0
+    int zc_refill_pending;          // READ_FILE deferred until notifications drain
+    int zc_closing;                 // close deferred until notifications drain
+    int zc_finish_pending;          // keep-alive reset deferred until notifications drain
+    int keep_alive;                 // conn stays open after the current request
+    int pipe_fds[2];                // splice pipe, -1 until first splice GET
+    size_t pipe_pending;            // bytes in the pipe not yet sent to client
+    size_t header_len;
+    size_t header_sent;             // header bytes already on the wire
+    char *carry;                    // pipelined bytes that arrived behind the current request
+    size_t carry_len;
+    open_request *open_req;         // uring GET open/statx state, NULL when none is in flight
+    size_t header_buffer_processed; // to track request read/sent bytes
+    struct __kernel_timespec deadline; // CLOCK_MONOTONIC, set by conn_touch_deadline()
+    int header_deadline_set;        // deadline already covers the header of the current request
+    int timer_slot;                 // timer wheel list holding the conn, -1 when not scheduled
+    int timer_next, timer_prev;     // timer wheel links (table indices), -1 terminated
+    uint64_t timer_expire;          // deadline in wheel ticks
 
-    ssize_t last_aio_res; // last aio result
-    struct iocb aio_iocb; // Single iocb for the current async op
+    // cold, written before it is read so a reused slot doesn't clear it
+    _Alignas(CACHE_LINE) http_parser parser; // header parse state of the current request
+    char header[256];                         // uring GET response header, goes out with the first body chunk
+    struct iovec send_iov[2];                 // header + body of the coalesced send, live until it completes
+    struct msghdr send_msg;
+    ssize_t last_aio_res;                     // last aio result
+    struct iocb aio_iocb;                     // Single iocb for the current async op
     // struct iocb *aio_iocbs; // Array of iocb pointers for io_submit
+
+    // connection table bookkeeping, survives reuse of the slot
+    uint32_t gen; // bumped on every free, stale handles stop resolving
+    int index;
+    int next_free;
 } conn_state;
 
+_Static_assert(offsetof(conn_state, file_entry) == CACHE_LINE, "hot conn_state fields must fit one cache line");
+
 void send_response(int client_socket, const char *status, const char *content_type, const char *body);
+void init_static_responses();
+void send_static_response(int client_socket, static_response resp);
+parse_status parse_request(http_parser *parser, const char *buf, size_t len);
+int slice_eq(http_slice s, const char *str);
+int wants_keep_alive(const http_request *req);
+int stash_pipelined(conn_state *conn, size_t request_end);
+void reset_conn(conn_state *conn);
+void *io_pool_map(size_t bytes, int prefault);
+void io_pool_unmap(void *mem, size_t bytes);
+int io_pool_init(size_t count);
+char *io_buffer_get();
+void io_buffer_put(char *buf);
+conn_state *conn_alloc(int own_buffer);
+void conn_free(conn_state *conn);
+uint64_t conn_handle(const conn_state *conn);
+conn_state *conn_lookup(uint64_t handle);
+void conn_touch_deadline(conn_state *conn);
+void timer_wheel_schedule(conn_state *conn);
+void timer_wheel_cancel(conn_state *conn);
+conn_state *timer_wheel_expire();
+void put_file(int *file_fd, file_cache_entry **entry);
+void fd_cache_invalidate(const char *path);
+void fd_cache_stats(unsigned long *hits, unsigned long *misses);
+int send_cached_response(int client_socket, const http_request *req, char *spill, size_t *spill_len,
+                         server_type s_type, int may_block);
+void resp_cache_stats(unsigned long *hits, unsigned long *misses);
+void cache_set_workers(int workers);
+void block_cache_bind(conn_state *conn);
+size_t block_cache_read(conn_state *conn, char *dst);
+void block_cache_store(conn_state *conn, off_t offset, const char *src, size_t len);
+void block_cache_stats(unsigned long *hits, unsigned long *misses);
 int handle_blocking_requests(int client_socket, int *file_fd, char *req_buffer);
 int handle_requests_event_driven(io_context_t *global_aio_ctx, int *global_aio_event_fd, conn_state *conn);
 int handle_requests_uring(struct io_uring *ring, conn_state *conn, ssize_t res);
 void submit_close(struct io_uring *ring, conn_state *conn);
 int io_uring_func(struct io_uring *ring, conn_state *conn, async_func_enum func);
+int setup_ring(unsigned entries, struct io_uring *ring, struct io_uring_params *params, int worker);
+int setup_buf_ring(struct io_uring *ring);
+int buf_ring_enabled();
+void adopt_provided_buf(conn_state *conn, struct io_uring_cqe *cqe);
+void recycle_provided_buf(conn_state *conn);
+int borrow_recv_buffer(conn_state *conn);
+int setup_registered_io(struct io_uring *ring);
+void register_conn_file(conn_state *conn);
+void release_conn_file(conn_state *conn);
+int setup_send_zc(struct io_uring *ring);
+int setup_linked_get(struct io_uring *ring);
+int setup_file_ring(struct io_uring *ring);
+int file_ring_enabled();
+int file_ring_fallback(struct io_uring *ring, conn_state *conn);
+int queue_get_chunk(struct io_uring *ring, conn_state *conn);
+int finish_request_uring(struct io_uring *ring, conn_state *conn);
+int handle_send_zc_notif(struct io_uring *ring, conn_state *conn);
+void submit_policy_queued();
+void submit_policy_reset();
+int submit_policy_pending();
+int submit_policy_flush(struct io_uring *ring, int drained);
+int submit_policy_wait(struct io_uring *ring, unsigned wait_nr, struct __kernel_timespec *ts);
+const char *ring_wait_describe();
+void ring_wait(struct io_uring *ring);
+void submit_policy_stats(unsigned long flushes[SUBMIT_REASONS], unsigned long *sqes, unsigned *batch);
+void ring_stats_tick(int worker);
 
 void reset_req_counter();
 int get_req_counter();
 void increment_req_counter();
 void add_to_iocbs(struct iocb *aio_iocb);
-void submit_iocbs(struct io_context_t ctx)
+void submit_iocbs(io_context_t ctx);
 
-#endif
\ No newline at end of file
+#endif
@@ -15,7 +15,7 @@ void add_to_iocbs(struct iocb *aio_iocb)
     pending_aio_iocbs[get_req_counter()] = aio_iocb;
     increment_req_counter();
 }
-void submit_iocbs(struct io_context_t ctx)
+void submit_iocbs(io_context_t ctx)
 {
     int ret = io_submit(ctx, get_req_counter(), pending_aio_iocbs);
     if (ret < 0)
@@ -45,13 +45,23 @@ void cleanup_connection(int epoll_fd, conn_state *conn)
     if (!conn)
         return;
     epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
-    if (conn->file_fd != -1)
-        close(conn->file_fd);
+    put_file(&conn->file_fd, &conn->file_entry);
     if (conn->fd != -1)
         close(conn->fd);
-    if (conn->req_buffer)
-        free(conn->req_buffer);
-    free(conn);
+    free(conn->carry);
+    conn_free(conn);
+}
+
+// deadline for what the conn waits on next, a conn waiting on its aio isn't timed since the
+// kernel still owns its buffer
+static void rearm_conn_timer(conn_state *conn)
+{
+    if (!USE_CONN_TIMEOUTS)
+        return;
+    if (conn->state == WAITING_FOR_AIO_READ || conn->state == WAITING_FOR_AIO_WRITE)
+        timer_wheel_cancel(conn);
+    else
+        timer_wheel_schedule(conn);
 }
 
 int init_aio_context(io_context_t *ctx, int *event_fd, unsigned int max_events)
@@ -76,6 +86,10 @@ int init_aio_context(io_context_t *ctx, int *event_fd, unsigned int max_events)
 
 int main()
 {
+    init_static_responses();
+    if (io_pool_init(IO_POOL_PREFAULT) < 0)
+        return 1;
+
     cpu_set_t cpuset;
     CPU_ZERO(&cpuset);
     CPU_SET(1, &cpuset); // Pin to core 0
@@ -153,7 +167,7 @@ int main()
 
     // Add global_aio_event_fd to epoll
     event.events = EPOLLIN | EPOLLET;
-    event.data.fd = global_aio_event_fd;
+    event.data.u64 = global_aio_event_fd; // generation 0, never mistaken for a conn handle
     if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, global_aio_event_fd, &event) == -1)
     {
         perror("Error adding global_aio_event_fd socket to epoll");
@@ -166,7 +180,7 @@ int main()
 
     // adding server sockets to epoll
     event.events = EPOLLIN;
-    event.data.fd = server_socket;
+    event.data.u64 = server_socket;
     if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &event) == -1)
     {
         perror("Error adding server socket to epoll");
@@ -192,7 +206,8 @@ int main()
             reset_req_counter();
         }
 
-        int ready_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        // the timeout ticks the timer wheel
+        int ready_events = epoll_wait(epoll_fd, events, MAX_EVENTS, USE_CONN_TIMEOUTS ? TIMER_TICK_MS : -1);
         if (ready_events < 0)
         {
             // If epoll_wait was interrupted by a signal, continue
@@ -204,7 +219,7 @@ int main()
 
         for (int i = 0; i < ready_events; i++)
         {
-            if (events[i].data.fd == server_socket)
+            if (events[i].data.u64 == (uint64_t)server_socket)
             {
                 // drain accept events from listen queue
                 while (1)
@@ -225,37 +240,27 @@ int main()
                     // printf("Connection accepted from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
 
                     // initializing connection state for client
-                    conn_state *conn = malloc(sizeof(conn_state));
+                    conn_state *conn = conn_alloc(1);
                     if (!conn)
                     {
-                        perror("Failed to allocate conn_state");
                         close(client_socket);
                         continue;
                     }
-                    memset(conn, 0, sizeof(conn_state));
-                    if (posix_memalign((void **)&conn->req_buffer, MY_BLOCK_SIZE, BUFFER_SIZE) != 0)
-                    {
-                        perror("Failed to allocate aligned buffer");
-                        free(conn);
-                        close(client_socket);
-                        continue;
-                    }
-                    memset(conn->req_buffer, 0, BUFFER_SIZE);
                     conn->fd = client_socket;
-                    conn->file_fd = -1;
-                    conn->state = READING_HEADER;
 
                     // adding client socket to epoll to monitor io events
                     uint32_t events_to_set = EPOLLIN | EPOLLET | EPOLLRDHUP;
-                    struct epoll_event client_event = {.events = events_to_set, .data.ptr = conn, .data.fd = client_socket};
+                    struct epoll_event client_event = {.events = events_to_set, .data.u64 = conn_handle(conn)};
                     if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &client_event) == -1)
                     {
                         perror("ERROR: epoll_ctl ADD after client socket accept");
                         cleanup_connection(epoll_fd, conn); // Clean up on error
+                        continue;
                     }
+                    rearm_conn_timer(conn);
                 }
             }
-            else if (events[i].data.fd == global_aio_event_fd)
+            else if (events[i].data.u64 == (uint64_t)global_aio_event_fd)
             {
                 uint64_t completed_aio_ops;
 
@@ -277,11 +282,11 @@ int main()
 
                 for (int j = 0; j < num_completed; ++j)
                 {
-                    conn_state *conn = (conn_state *)aio_events[j].data;
+                    conn_state *conn = conn_lookup((uintptr_t)aio_events[j].data);
 
                     if (!conn)
                     {
-                        printf("AIO completion with NULL conn!\n");
+                        printf("AIO completion for a closed conn\n");
                         continue;
                     }
                     ssize_t res = aio_events[j].res;
@@ -292,23 +297,23 @@ int main()
                     {
                         fprintf(stderr, "Async request failed: %s for state: %d\n",
                                 strerror(-res2), conn->state);
-                        send_response(conn->fd, "HTTP/1.1 500 Internal Server Error", "text/plain", "File I/O Error.");
+                        send_static_response(conn->fd, RESP_FILE_IO_ERROR);
                         cleanup_connection(epoll_fd, conn);
                         continue;
                     }
                     else if (res == 0)
                     {
                         if (conn->state == WAITING_FOR_AIO_READ)
-                            send_response(conn->fd, "HTTP/1.1 200 OK", "text/plain", "File sent.");
+                            send_static_response(conn->fd, RESP_FILE_SENT);
                         else if (conn->state == WAITING_FOR_AIO_WRITE)
                         {
                             if (conn->byte_offset >= conn->file_size)
                             {
-                                send_response(conn->fd, "HTTP/1.1 201 Created", "text/plain", "File uploaded.");
+                                send_static_response(conn->fd, RESP_CREATED);
                                 return CONN_CLOSED;
                             }
                         }
-                        send_response(conn->fd, "HTTP/1.1 500 Internal Server Error", "text/plain", "File write error (0 bytes written).");
+                        send_static_response(conn->fd, RESP_FILE_WRITE_ERROR);
                         fprintf(stderr, "AIO operation returned 0 bytes for FD %d, state %d. Possible EOF/Error.\n",
                                 conn->file_fd, conn->state);
 
@@ -330,22 +335,25 @@ int main()
                         else
                             events_to_set = EPOLLIN;
                         events_to_set |= EPOLLET | EPOLLRDHUP;
-                        struct epoll_event client_event = {.events = events_to_set, .data.ptr = conn};
+                        struct epoll_event client_event = {.events = events_to_set, .data.u64 = conn_handle(conn)};
                         if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &client_event) == -1)
                             perror("ERROR: epoll_ctl MOD after AIO completion");
+                        rearm_conn_timer(conn);
                     }
 
                     else if (status == CONN_CLOSED || status == CONN_ERROR)
                     {
                         if (status == CONN_ERROR)
-                            send_response(conn->fd, "HTTP/1.1 500 Internal Server Error", "text/plain", "Internal Server Error");
+                            send_static_response(conn->fd, RESP_INTERNAL_ERROR);
                         cleanup_connection(epoll_fd, conn);
                     }
                 }
             }
             else
             {
-                conn_state *conn = (conn_state *)events[i].data.ptr;
+                conn_state *conn = conn_lookup(events[i].data.u64);
+                if (!conn)
+                    continue; // closed while this event was queued
                 int status = handle_requests_event_driven(&global_aio_ctx, &global_aio_event_fd, conn);
 
                 if (status == CONN_ALIVE)
@@ -360,18 +368,28 @@ int main()
                     else
                         events_to_set = EPOLLIN;
                     events_to_set |= EPOLLET | EPOLLRDHUP;
-                    struct epoll_event client_event = {.events = events_to_set, .data.ptr = conn};
+                    struct epoll_event client_event = {.events = events_to_set, .data.u64 = conn_handle(conn)};
                     if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &client_event) == -1)
                         perror("ERROR: epoll_ctl MOD after network event processing");
+                    rearm_conn_timer(conn);
                 }
                 else if (status == CONN_CLOSED || status == CONN_ERROR)
                 {
                     if (status == CONN_ERROR)
-                        send_response(conn->fd, "HTTP/1.1 500 Internal Server Error", "text/plain", "Internal Server Error");
+                        send_static_response(conn->fd, RESP_INTERNAL_ERROR);
                     cleanup_connection(epoll_fd, conn);
                 }
             }
         }
+
+        // only the wheel lists that came due are walked, idle conns cost nothing here
+        conn_state *expired;
+        while (USE_CONN_TIMEOUTS && (expired = timer_wheel_expire()))
+        {
+            if (expired->state == READING_HEADER && expired->bytes_read > 0)
+                send_static_response(expired->fd, RESP_REQUEST_TIMEOUT);
+            cleanup_connection(epoll_fd, expired);
+        }
     }
 
     // CLOSE
@@ -4,11 +4,31 @@
 
 #define QUEUE_DEPTH 8192
 
-static atomic_int req_counter = 0;
-
-void reset_req_counter() { atomic_store(&req_counter, 0); }
-int get_req_counter() { return atomic_load(&req_counter); }
-void increment_req_counter() { atomic_fetch_add(&req_counter, 1); }
+#ifndef USE_MULTISHOT_ACCEPT
+#define USE_MULTISHOT_ACCEPT 1 // 1 = one armed accept SQE yields a CQE per client, 0 = one accept SQE per client
+#endif
+#ifndef USE_BUF_RING
+#define USE_BUF_RING 1 // 1 = recv into kernel provided buffers, 0 = 64kb buffer per connection
+#endif
+#ifndef USE_SEND_ZC
+#define USE_SEND_ZC 1 // 1 = GET chunks go out with IORING_OP_SEND_ZC when the kernel has it
+#endif
+#ifndef USE_LINKED_GET
+#define USE_LINKED_GET 1 // 1 = full GET chunks go out as one linked read -> send chain
+#endif
+#ifndef USE_REGISTERED_IO
+#define USE_REGISTERED_IO 1 // 1 = READ_FIXED/WRITE_FIXED on registered files and buffers
+#endif
+#ifndef USE_IOPOLL_RING
+#define USE_IOPOLL_RING 0 // 1 = O_DIRECT file reads/writes go to a polled ring, needs NVMe poll queues
+#endif
+
+static int multishot_accept = USE_MULTISHOT_ACCEPT;
+
+// SQE bookkeeping stays with the ring's own thread, see submit_policy_flush()
+void reset_req_counter() { submit_policy_reset(); }
+int get_req_counter() { return submit_policy_pending(); }
+void increment_req_counter() { submit_policy_queued(); }
 
 void make_non_blocking(int socket_fd)
 {
@@ -44,21 +64,14 @@ int add_accept_request(int server_socket, struct io_uring *ring, struct sockaddr
         }
     }
 
-    // initializing connection state for client
-    conn_state *conn = malloc(sizeof(conn_state));
-    memset(conn, 0, sizeof(conn_state));
-    if (posix_memalign((void **)&conn->req_buffer, MY_BLOCK_SIZE, BUFFER_SIZE) != 0)
-    {
-        perror("Failed to allocate aligned buffer");
-        free(conn);
+    // initializing connection state for client, with a buffer ring the first recv brings its own buffer
+    conn_state *conn = conn_alloc(!buf_ring_enabled());
+    if (!conn)
         return CONN_ERROR;
-    }
-    memset(conn->req_buffer, 0, BUFFER_SIZE);
-    conn->file_fd = -1;
     conn->state = ACCEPTING_CONNECTION;
     io_uring_prep_accept(sqe, server_socket, (struct sockaddr *)client_addr,
                          client_len, SOCK_NONBLOCK);
-    io_uring_sqe_set_data(sqe, conn);
+    io_uring_sqe_set_data64(sqe, conn_handle(conn));
     return CONN_ALIVE;
 }
 
@@ -66,13 +79,93 @@ void close_conn(conn_state *conn)
 {
     if (!conn)
         return;
-    if (conn->file_fd != -1)
-        close(conn->file_fd);
+    // kernel still reads req_buffer, finish once the last send_zc notification arrives
+    if (conn->zc_notif_pending > 0)
+    {
+        conn->zc_closing = 1;
+        return;
+    }
+    release_conn_file(conn);
+    put_file(&conn->file_fd, &conn->file_entry);
     if (conn->fd != -1)
         close(conn->fd);
-    if (conn->req_buffer)
-        free(conn->req_buffer);
-    free(conn);
+    if (conn->pipe_fds[0] != -1)
+    {
+        close(conn->pipe_fds[0]);
+        close(conn->pipe_fds[1]);
+    }
+    if (conn->buf_id != -1)
+        recycle_provided_buf(conn);
+    free(conn->carry);
+    free(conn->open_req);
+    conn_free(conn);
+}
+
+conn_state *alloc_conn(int client_socket)
+{
+    // with a buffer ring the first recv brings its own buffer
+    conn_state *conn = conn_alloc(!buf_ring_enabled());
+    if (!conn)
+        return NULL;
+    conn->fd = client_socket;
+    return conn;
+}
+
+int add_multishot_accept_request(int server_socket, struct io_uring *ring)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    if (!sqe)
+    {
+        io_uring_submit(ring);
+        reset_req_counter();
+        sqe = io_uring_get_sqe(ring);
+        if (!sqe)
+        {
+            fprintf(stderr, "Failed to get SQE in add_multishot_accept_request: %s\n", strerror(errno));
+            return CONN_ERROR;
+        }
+    }
+
+    // no sockaddr, the client address is never used
+    io_uring_prep_multishot_accept(sqe, server_socket, NULL, NULL, SOCK_NONBLOCK);
+    io_uring_sqe_set_data64(sqe, ACCEPT_HANDLE);
+    return CONN_ALIVE;
+}
+
+int handle_multishot_accept(int server_socket, struct io_uring *ring, struct io_uring_cqe *cqe)
+{
+    if (cqe->res >= 0)
+    {
+        conn_state *conn = alloc_conn(cqe->res);
+        if (!conn)
+            close(cqe->res);
+        else if (io_uring_func(ring, conn, RECV_REQUEST) < 0)
+            close_conn(conn);
+    }
+    else if (cqe->res == -EINVAL && !(cqe->flags & IORING_CQE_F_MORE))
+    {
+        // kernel < 5.19, fall back to one accept SQE per client
+        fprintf(stderr, "Multishot accept not supported, falling back to single accepts\n");
+        multishot_accept = 0;
+        for (int i = 0; i < 10; i++)
+        {
+            if (add_accept_request(server_socket, ring, NULL, NULL) < 0)
+                return CONN_ERROR;
+            increment_req_counter();
+        }
+        return CONN_ALIVE;
+    }
+    else
+        fprintf(stderr, "Multishot accept failed: %s\n", strerror(-cqe->res));
+
+    // without IORING_CQE_F_MORE the kernel has dropped the accept and it must be re-armed
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        if (add_multishot_accept_request(server_socket, ring) < 0)
+            return CONN_ERROR;
+        increment_req_counter();
+    }
+    return CONN_ALIVE;
 }
 
 void print_sq_poll_kernel_thread_status()
@@ -92,6 +185,10 @@ int main()
     struct io_uring_params params;
     struct io_uring_cqe *cqe;
 
+    init_static_responses();
+    if (io_pool_init(IO_POOL_PREFAULT) < 0)
+        return 1;
+
     // CREATE
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket < 0)
@@ -130,7 +227,7 @@ int main()
     memset(&params, 0, sizeof(params));
     params.flags |= IORING_SETUP_SQPOLL;
     params.sq_thread_idle = 2000;
-    if (io_uring_queue_init_params(QUEUE_DEPTH, &ring, &params) < 0)
+    if (setup_ring(QUEUE_DEPTH, &ring, &params, 0) < 0)
     {
         perror("Error initializing io_uring");
         close(server_socket);
@@ -138,32 +235,59 @@ int main()
         return 1;
     }
 
+    if (USE_BUF_RING && setup_buf_ring(&ring) < 0)
+        printf("Provided buffer ring unavailable, using per connection buffers\n");
+    if (USE_REGISTERED_IO && setup_registered_io(&ring) < 0)
+        printf("Registered files/buffers unavailable, using plain read/write\n");
+    if (USE_SEND_ZC && setup_send_zc(&ring) < 0)
+        printf("IORING_OP_SEND_ZC not supported, using copying sends\n");
+    if (USE_LINKED_GET && setup_linked_get(&ring) < 0)
+        printf("IORING_FEAT_CQE_SKIP not available, GET chunks are not linked\n");
+    if (USE_IOPOLL_RING && setup_file_ring(&ring) < 0)
+        printf("IOPOLL file ring unavailable, file IO stays on the socket ring\n");
+
     printf("Server listening on PORT %d\n", SERVER_PORT);
 
     // ALLOW
-    // 1st connection req
-    struct sockaddr_in client_addr1;
-    socklen_t client_len1 = sizeof(client_addr1);
-    if (add_accept_request(server_socket, &ring, &client_addr1, &client_len1) < 0)
+    if (multishot_accept)
     {
-        perror("Error accepting 1st connection");
-        close(server_socket);
-        exit(1);
-        return 1;
+        // one armed accept covers every incoming client
+        if (add_multishot_accept_request(server_socket, &ring) < 0)
+        {
+            perror("Error arming multishot accept");
+            close(server_socket);
+            exit(1);
+            return 1;
+        }
+        io_uring_submit(&ring);
     }
-    io_uring_submit(&ring);
-
-    // Pre-seed with multiple accept requests
-    for (int i = 0; i < 10; i++)
+    else
     {
-        if (add_accept_request(server_socket, &ring, &client_addr, &client_len) < 0)
+        // 1st connection req
+        struct sockaddr_in client_addr1;
+        socklen_t client_len1 = sizeof(client_addr1);
+        if (add_accept_request(server_socket, &ring, &client_addr1, &client_len1) < 0)
         {
-            fprintf(stderr, "Failed to add initial accept request\n");
+            perror("Error accepting 1st connection");
             close(server_socket);
+            exit(1);
             return 1;
         }
+        io_uring_submit(&ring);
+
+        // Pre-seed with multiple accept requests
+        for (int i = 0; i < 10; i++)
+        {
+            if (add_accept_request(server_socket, &ring, NULL, NULL) < 0)
+            {
+                fprintf(stderr, "Failed to add initial accept request\n");
+                close(server_socket);
+                return 1;
+            }
+        }
     }
 
+    printf("CQ wait: %s\n", ring_wait_describe());
     printf("SQPOLL thread active (thread ID: %d)\n", print_sq_poll_kernel_thread_status());
 
     while (1)
@@ -181,42 +305,97 @@ int main()
         }
         if (ret == 0)
         {
-            // no res availble yet so continue loop
-            // Submit any prepared SQEs if we have a batch
-            if (get_req_counter() > 0)
-            {
-                io_uring_submit(&ring);
-                reset_req_counter();
-            }
+            // no res availble yet, queued SQEs go out and the loop spins and/or sleeps
+            ring_wait(&ring);
+            ring_stats_tick(0);
             continue;
         }
         cqe_count = ret;
 
         for (unsigned i = 0; i < cqe_count; i++)
         {
+            if (i > 0)
+                submit_policy_flush(&ring, 0); // SQEs of the previous completions
             cqe = cqes[i];
-            conn_state *conn = (conn_state *)io_uring_cqe_get_data(cqe);
-            ssize_t res = cqe->res;
+            uint64_t data = io_uring_cqe_get_data64(cqe);
+            if (data & LINKED_READ_TAG)
+            {
+                // failed/short linked read, the cancelled send cqe behind it closes the conn
+                fprintf(stderr, "Linked GET read failed: %d\n", cqe->res);
+                continue;
+            }
+            if (data == LINK_TIMEOUT_HANDLE)
+                continue; // the op it bounded reports the outcome
+            if (data == ACCEPT_HANDLE)
+            {
+                if (handle_multishot_accept(server_socket, &ring, cqe) < 0)
+                    fprintf(stderr, "Failed to re-arm multishot accept\n");
+                continue;
+            }
 
+            // NULL once the conn was closed, its slot may already serve another client
+            conn_state *conn = conn_lookup(data);
+            ssize_t res = cqe->res;
             if (!conn)
                 continue;
 
+            if (cqe->flags & IORING_CQE_F_NOTIF)
+            {
+                int status = handle_send_zc_notif(&ring, conn);
+                if (status == CONN_CLOSED || status == CONN_ERROR)
+                    close_conn(conn);
+                continue;
+            }
+            if (cqe->flags & IORING_CQE_F_MORE)
+                conn->zc_notif_pending++; // send_zc result, its notification follows
+
+            if (cqe->flags & IORING_CQE_F_BUFFER)
+                adopt_provided_buf(conn, cqe);
+
+            if (conn->state == OPENING_FILE || conn->state == STATING_FILE)
+            {
+                // file lookup, not a socket op: errors are answered by the handler and statx succeeds with 0
+                int status = handle_requests_uring(&ring, conn, res);
+                if (status == CONN_CLOSED || status == CONN_ERROR)
+                    close_conn(conn);
+                continue;
+            }
+
             if (res < 0)
             {
+                if (res == -ECANCELED)
+                {
+                    // its linked timeout fired, or the linked read ahead of it failed
+                    if (conn->state == READING_HEADER && conn->bytes_read > 0)
+                        send_static_response(conn->fd, RESP_REQUEST_TIMEOUT);
+                    close_conn(conn);
+                    continue;
+                }
                 if (res == -EAGAIN || res == -EWOULDBLOCK)
                     continue;
+                if (res == -EOPNOTSUPP && file_ring_fallback(&ring, conn) == CONN_ALIVE)
+                    continue; // polled I/O unsupported for this file, resubmitted on this ring
+                if (res == -ENOBUFS)
+                {
+                    // buffer ring drained, resubmitting into it would just spin until a buffer comes back
+                    if (borrow_recv_buffer(conn) < 0 || io_uring_func(&ring, conn, RECV_REQUEST) < 0)
+                        close_conn(conn);
+                    continue;
+                }
                 fprintf(stderr, "Async request failed: %s for state: %d\n",
                         strerror(-cqe->res), conn->state);
                 if (conn->fd)
-                    send_response(conn->fd, "HTTP/1.1 400 Bad Request", "text/plain", "Malformed Request.");
+                    send_static_response(conn->fd, RESP_MALFORMED);
                 close_conn(conn);
+                continue;
             }
             else if (res == 0)
             {
                 fprintf(stderr, "Client disconnected: %s for state: %d\n",
                         strerror(-cqe->res), conn->state);
-                // send_response(conn->fd, "HTTP/1.1 400 Bad Request", "text/plain", "Client Disconnected");
+                // send_static_response(conn->fd, RESP_CLIENT_DISCONNECTED);
                 close_conn(conn);
+                continue;
             }
 
             // printf("Connection accepted from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
@@ -231,10 +410,8 @@ int main()
                     close_conn(conn);
                     continue;
                 }
-                struct sockaddr_in client_addr;
-                socklen_t client_len = sizeof(client_addr);
-
-                if (add_accept_request(server_socket, &ring, &client_addr, &client_len) < 0)
+                // client address is unused, don't hand the kernel a stack slot that goes out of scope
+                if (add_accept_request(server_socket, &ring, NULL, NULL) < 0)
                     continue;
                 increment_req_counter();
             }
@@ -246,19 +423,15 @@ int main()
                 {
                     if (status == CONN_ERROR)
                     {
-                        send_response(conn->fd, "HTTP/1.1 500 Internal Server Error", "text/plain", "Internal Server Error");
+                        send_static_response(conn->fd, RESP_INTERNAL_ERROR);
                     }
                     close_conn(conn);
                 }
             }
         }
 
-        // Submit any prepared SQEs if we have a batch
-        if (get_req_counter() > BATCH_SIZE)
-        {
-            io_uring_submit(&ring);
-            reset_req_counter();
-        }
+        // a short peek emptied the CQ
+        submit_policy_flush(&ring, cqe_count < BATCH_SIZE);
 
         // if (io_uring_sq_ready(&ring) > QUEUE_DEPTH / 2)
         //     io_uring_submit(&ring); // Manual kick
@@ -2,8 +2,18 @@
 
 #include <signal.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #define ACCEPT_TIMEOUT_MS 100
 #define MAX_PENDING_ACCEPTS 2048
+#define DEFAULT_WORKERS 4
+#define MAX_WORKERS 256
+#define RESPAWN_MIN_UPTIME_MS 1000 // a worker dying sooner counts as a startup failure
+#define RESPAWN_BACKOFF_MS 100     // first delay after a startup failure, doubles per repeat
+#define RESPAWN_BACKOFF_MAX_MS 5000
+
+#ifndef USE_PREFORK
+#define USE_PREFORK 1 // 1 = long-lived worker processes, 0 = fork per connection
+#endif
 
 void make_non_blocking(int socket_fd)
 {
@@ -20,37 +30,22 @@ void make_non_blocking(int socket_fd)
     }
 }
 
-int main()
+int create_listener(int non_blocking)
 {
-    cpu_set_t cpuset;
-    CPU_ZERO(&cpuset);
-    CPU_SET(1, &cpuset); // Pin to core 0
-
-    if (sched_setaffinity(getpid(), sizeof(cpu_set_t), &cpuset) == -1)
-    {
-        perror("sched_setaffinity");
-        // Handle error
-    }
-    else
-    {
-        printf("Process %d pinned to core 1.\n", getpid());
-    }
     int server_socket;
     struct sockaddr_in server_addr;
 
-    // Avoid child from becoming a zombie process
-    signal(SIGCHLD, SIG_IGN);
-
     // CREATE
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket < 0)
     {
         perror("Error creating socket");
-        return 1;
+        return -1;
     }
 
     // make the server socket non-blocking
-    make_non_blocking(server_socket);
+    if (non_blocking)
+        make_non_blocking(server_socket);
 
     int enable = 1;
     setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
@@ -65,15 +60,187 @@ int main()
     {
         perror("Error binding socket");
         close(server_socket);
-        return 1;
+        return -1;
     }
 
     // LISTEN
     if (listen(server_socket, ACCEPT_BACKLOG) < 0)
     {
         perror("Error listening on socket");
-        return 1;
+        close(server_socket);
+        return -1;
     }
+    return server_socket;
+}
+
+void serve_connection(int client_socket, char *req_buffer)
+{
+    int file_fd = -1;
+    int res = handle_blocking_requests(client_socket, &file_fd, req_buffer);
+    if (res == CONN_ERROR)
+    {
+        send_static_response(client_socket, RESP_INTERNAL_ERROR);
+    }
+    if (file_fd != -1)
+        close(file_fd);
+    close(client_socket);
+}
+
+// prefork worker, own SO_REUSEPORT listener and io buffer for its whole life
+void worker_process(int id)
+{
+    int server_socket = create_listener(0);
+    if (server_socket < 0)
+        exit(1);
+
+    // the pool is mapped after the fork, a parent mapping would be shared copy-on-write
+    char *req_buffer = io_buffer_get();
+    if (!req_buffer)
+        exit(1);
+
+    printf("Worker %d (pid %d) listening on port %d\n", id, getpid(), SERVER_PORT);
+    while (1)
+    {
+        int client_socket = accept(server_socket, NULL, NULL);
+        if (client_socket < 0)
+        {
+            if (errno != EINTR)
+                perror("Error accepting connection");
+            continue;
+        }
+        serve_connection(client_socket, req_buffer);
+    }
+}
+
+pid_t spawn_worker(int id)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        worker_process(id);
+        exit(0);
+    }
+    if (pid < 0)
+        perror("Failed to fork worker");
+    return pid;
+}
+
+static long long monotonic_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+static int next_backoff(int backoff_ms)
+{
+    backoff_ms = backoff_ms ? backoff_ms * 2 : RESPAWN_BACKOFF_MS;
+    return backoff_ms > RESPAWN_BACKOFF_MAX_MS ? RESPAWN_BACKOFF_MAX_MS : backoff_ms;
+}
+
+// supervisor, doesn't listen itself and restarts any worker that dies. a worker that dies right
+// after starting (bind failure, no buffers) and a failed fork are retried with a doubling delay
+int run_prefork(int num_workers)
+{
+    pid_t pids[MAX_WORKERS];
+    long long started_at[MAX_WORKERS];
+    long long respawn_at[MAX_WORKERS];
+    int backoff_ms[MAX_WORKERS];
+    for (int i = 0; i < num_workers; i++)
+    {
+        pids[i] = -1;
+        respawn_at[i] = 0;
+        backoff_ms[i] = 0;
+    }
+
+    while (1)
+    {
+        long long now = monotonic_ms();
+        long long next_respawn = -1;
+        for (int i = 0; i < num_workers; i++)
+        {
+            if (pids[i] <= 0 && respawn_at[i] <= now)
+            {
+                started_at[i] = now;
+                if ((pids[i] = spawn_worker(i)) < 0)
+                {
+                    backoff_ms[i] = next_backoff(backoff_ms[i]);
+                    respawn_at[i] = now + backoff_ms[i];
+                    fprintf(stderr, "Worker %d not started, retrying in %d ms\n", i, backoff_ms[i]);
+                }
+            }
+            if (pids[i] <= 0 && (next_respawn == -1 || respawn_at[i] < next_respawn))
+                next_respawn = respawn_at[i];
+        }
+
+        // with a restart pending, reap without blocking and nap until it is due
+        int status;
+        pid_t dead = waitpid(-1, &status, next_respawn == -1 ? 0 : WNOHANG);
+        if (dead == 0 || (dead < 0 && errno == ECHILD && next_respawn != -1))
+        {
+            long long wait_ms = next_respawn - monotonic_ms();
+            if (wait_ms > 0)
+                usleep((wait_ms < 100 ? wait_ms : 100) * 1000);
+            continue;
+        }
+        if (dead < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("waitpid");
+            return 1;
+        }
+        for (int i = 0; i < num_workers; i++)
+        {
+            if (pids[i] != dead)
+                continue;
+            pids[i] = -1;
+            now = monotonic_ms();
+            backoff_ms[i] = now - started_at[i] < RESPAWN_MIN_UPTIME_MS ? next_backoff(backoff_ms[i]) : 0;
+            respawn_at[i] = now + backoff_ms[i];
+            fprintf(stderr, "Worker %d (pid %d) exited with status %d, restarting in %d ms\n", i, dead, status,
+                    backoff_ms[i]);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    init_static_responses(); // forked children inherit the rendered table
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(1, &cpuset); // Pin to core 0
+
+    if (sched_setaffinity(getpid(), sizeof(cpu_set_t), &cpuset) == -1)
+    {
+        perror("sched_setaffinity");
+        // Handle error
+    }
+    else
+    {
+        printf("Process %d pinned to core 1.\n", getpid());
+    }
+
+    if (USE_PREFORK)
+    {
+        // optional worker count
+        int num_workers = argc > 1 ? atoi(argv[1]) : DEFAULT_WORKERS;
+        if (num_workers < 1 || num_workers > MAX_WORKERS)
+        {
+            fprintf(stderr, "Worker count must be between 1 and %d\n", MAX_WORKERS);
+            return 1;
+        }
+        cache_set_workers(num_workers); // forked workers split the cache budgets too
+        return run_prefork(num_workers);
+    }
+
+    // Avoid child from becoming a zombie process
+    signal(SIGCHLD, SIG_IGN);
+
+    int server_socket = create_listener(1);
+    if (server_socket < 0)
+        return 1;
 
     printf("Server listening on port %d\n", SERVER_PORT);
 
@@ -114,23 +281,15 @@ int main()
             }
             else if (pid == 0)
             {
-                int file_fd;
                 char *req_buffer;
                 if (posix_memalign((void **)&req_buffer, MY_BLOCK_SIZE, BUFFER_SIZE) != 0)
                 {
                     perror("Failed to allocate aligned buffer");
-                    close(client_socket);
-                    continue;
-                }
-                memset(req_buffer, 0, BUFFER_SIZE);
-                int res = handle_blocking_requests(accepted_sockets[i], &file_fd, req_buffer);
-                if (res == CONN_ERROR)
-                {
-                    send_response(client_socket, "HTTP/1.1 500 Internal Server Error", "text/plain", "Internal Server Error");
+                    close(accepted_sockets[i]);
+                    exit(1);
                 }
-                close(file_fd);
+                serve_connection(accepted_sockets[i], req_buffer);
                 free(req_buffer);
-                close(accepted_sockets[i]);
                 exit(0);
             }
             else
@@ -143,4 +302,4 @@ int main()
     // CLOSE
     close(server_socket);
     printf("Connection closed.\n");
-}
\ No newline at end of file
+}
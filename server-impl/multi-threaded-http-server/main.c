@@ -1,51 +1,148 @@
 #include "request-handler.h"
 
 #include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include <sys/time.h>
 
 #define MAX_PENDING_ACCEPTS 2048
+#define DEFAULT_POOL_SIZE 8
+#define MAX_POOL_SIZE 256
+#define FD_QUEUE_SIZE 4096 // power of 2
 
-void *handle_client(void *arg)
+_Static_assert((FD_QUEUE_SIZE & (FD_QUEUE_SIZE - 1)) == 0,
+               "FD_QUEUE_SIZE must be a power of 2");
+
+// bounded lock-free MPMC queue of accepted fds, each slot's seq says whose turn it is
+typedef struct
+{
+    atomic_size_t seq;
+    int fd;
+} fd_slot;
+
+typedef struct
+{
+    fd_slot slots[FD_QUEUE_SIZE];
+    atomic_size_t head; // next slot to pop
+    atomic_size_t tail; // next slot to push
+    sem_t items;        // queued fds, idle workers sleep here
+    sem_t free_slots;   // free space, accept loop blocks here when workers are saturated
+} fd_queue;
+
+static fd_queue accept_queue;
+
+void fd_queue_init(fd_queue *q)
+{
+    for (size_t i = 0; i < FD_QUEUE_SIZE; i++)
+        atomic_store(&q->slots[i].seq, i);
+    atomic_store(&q->head, 0);
+    atomic_store(&q->tail, 0);
+    sem_init(&q->items, 0, 0);
+    sem_init(&q->free_slots, 0, FD_QUEUE_SIZE);
+}
+
+int fd_queue_push(fd_queue *q, int fd)
 {
-    int client_socket = *(int *)arg;
-    free(arg); // Free the allocated memory for the socket descriptor
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    while (1)
+    {
+        fd_slot *slot = &q->slots[pos & (FD_QUEUE_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            {
+                slot->fd = fd;
+                atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+                return 0;
+            }
+        }
+        else if (diff < 0)
+            return -1; // full
+        else
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    }
+}
 
+int fd_queue_pop(fd_queue *q)
+{
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    while (1)
+    {
+        fd_slot *slot = &q->slots[pos & (FD_QUEUE_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            {
+                int fd = slot->fd;
+                atomic_store_explicit(&slot->seq, pos + FD_QUEUE_SIZE, memory_order_release);
+                return fd;
+            }
+        }
+        else if (diff < 0)
+            return -1; // empty
+        else
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    }
+}
+
+void handle_client(int client_socket, char *req_buffer)
+{
+    int file_fd = -1;
+    int res = handle_blocking_requests(client_socket, &file_fd, req_buffer);
+    if (res == CONN_ERROR)
+    {
+        send_static_response(client_socket, RESP_INTERNAL_ERROR);
+    }
+    if (file_fd != -1)
+        close(file_fd);
+    close(client_socket);
+}
+
+// pool worker, pinned and given its io buffer once, then serves queued fds forever
+void *worker_loop(void *arg)
+{
+    long id = (long)arg;
     cpu_set_t cpuset;
     CPU_ZERO(&cpuset);
-    CPU_SET(1, &cpuset); // Pin to core 0
+    CPU_SET(1, &cpuset); // Pin to core 1
 
-    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) == -1)
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0)
     {
         perror("pthread_setaffinity_np");
         // Handle error
     }
     else
     {
-        printf("Thread %lu pinned to core %d.\n", (unsigned long)pthread_self(), 1);
+        printf("Worker %ld pinned to core %d.\n", id, 1);
     }
 
-    int file_fd;
-    char *req_buffer;
-    if (posix_memalign((void **)&req_buffer, MY_BLOCK_SIZE, BUFFER_SIZE) != 0)
-    {
-        perror("Failed to allocate aligned buffer");
-        close(client_socket);
-        return NULL;
-    }
-    memset(req_buffer, 0, BUFFER_SIZE);
-    int res = handle_blocking_requests(client_socket, &file_fd, req_buffer);
-    if (res == CONN_ERROR)
+    char *req_buffer = io_buffer_get();
+    if (!req_buffer)
+        exit(1);
+
+    while (1)
     {
-        send_response(client_socket, "HTTP/1.1 500 Internal Server Error", "text/plain", "Internal Server Error");
+        if (sem_wait(&accept_queue.items) == -1)
+            continue; // EINTR
+        int client_socket = fd_queue_pop(&accept_queue);
+        sem_post(&accept_queue.free_slots);
+        if (client_socket < 0)
+            continue;
+        handle_client(client_socket, req_buffer);
     }
-    close(file_fd);
-    free(req_buffer);
-    close(client_socket);
     return NULL;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
+    init_static_responses(); // handler threads only ever read it
+
     cpu_set_t cpuset;
     CPU_ZERO(&cpuset);
     CPU_SET(1, &cpuset); // Pin to core 0
@@ -94,56 +191,58 @@ int main()
         return 1;
     }
 
-    printf("Server listening on port %d\n", SERVER_PORT);
+    // optional pool size
+    long pool_size = argc > 1 ? atol(argv[1]) : DEFAULT_POOL_SIZE;
+    if (pool_size < 1 || pool_size > MAX_POOL_SIZE)
+    {
+        fprintf(stderr, "Pool size must be between 1 and %d\n", MAX_POOL_SIZE);
+        return 1;
+    }
+
+    // one prefaulted buffer per worker
+    if (io_pool_init(pool_size) < 0)
+        return 1;
+    cache_set_workers(pool_size);
+    fd_queue_init(&accept_queue);
+    for (long i = 0; i < pool_size; i++)
+    {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker_loop, (void *)i) != 0)
+        {
+            perror("pthread_create");
+            return 1;
+        }
+        pthread_detach(tid);
+    }
+
+    printf("Server listening on port %d with %ld workers\n", SERVER_PORT, pool_size);
 
     // ALLOW
     while (1)
     {
-        // Phase 1: Accept multiple connections quickly
-        int accepted_sockets[MAX_PENDING_ACCEPTS];
-        int accept_count = 0;
-
-        while (accept_count < MAX_PENDING_ACCEPTS)
+        // backpressure, wait for queue space before taking the next client off the backlog
+        if (sem_wait(&accept_queue.free_slots) == -1)
+            continue; // EINTR
+
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
+        if (client_socket < 0)
         {
-            struct sockaddr_in client_addr;
-            socklen_t client_len = sizeof(client_addr);
-            int client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
-            if (client_socket < 0)
-            {
-                if (errno == EWOULDBLOCK || errno == EAGAIN)
-                {
-                    // No more pending connections
-                    break;
-                }
-                perror("Error accepting connection");
-                continue;
-            }
-
-            // printf("Connection accepted from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-            accepted_sockets[accept_count++] = client_socket;
+            perror("Error accepting connection");
+            sem_post(&accept_queue.free_slots);
+            continue;
         }
-        // Phase 2: Handle accepted connections
-        for (int i = 0; i < accept_count; i++)
-        {
-            int *pclient = malloc(sizeof(int));
-            if (pclient == NULL)
-            {
-                perror("Failed to allocate memory for client socket");
-                close(client_socket);
-                continue;
-            }
-            *pclient = accepted_sockets[i];
 
-            pthread_t tid;
-            if (pthread_create(&tid, NULL, handle_client, pclient) != 0)
-            {
-                perror("pthread_create");
-                free(pclient);
-                close(accepted_sockets[i]);
-                continue;
-            }
-            pthread_detach(tid);
+        // printf("Connection accepted from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+        if (fd_queue_push(&accept_queue, client_socket) < 0)
+        {
+            fprintf(stderr, "Accept queue full\n");
+            close(client_socket);
+            sem_post(&accept_queue.free_slots);
+            continue;
         }
+        sem_post(&accept_queue.items);
     }
 
     // CLOSE
@@ -1,15 +1,52 @@
 #include "request-handler.h"
 
 #include <fcntl.h>
+#include <pthread.h>
 
 #define QUEUE_DEPTH 8192
+#define MAX_WORKERS 256
+#define FIRST_CORE 1 // worker i is pinned to core FIRST_CORE + i
+
+#ifndef USE_ATTACH_WQ
+#define USE_ATTACH_WQ 1 // 1 = all worker rings share the async worker pool of the first ring
+#endif
+
+#ifndef USE_MULTISHOT_ACCEPT
+#define USE_MULTISHOT_ACCEPT 1 // 1 = one armed accept SQE yields a CQE per client, 0 = one accept SQE per client
+#endif
+#ifndef USE_BUF_RING
+#define USE_BUF_RING 1 // 1 = recv into kernel provided buffers, 0 = 64kb buffer per connection
+#endif
+#ifndef USE_SEND_ZC
+#define USE_SEND_ZC 1 // 1 = GET chunks go out with IORING_OP_SEND_ZC when the kernel has it
+#endif
+#ifndef USE_LINKED_GET
+#define USE_LINKED_GET 1 // 1 = full GET chunks go out as one linked read -> send chain
+#endif
+#ifndef USE_REGISTERED_IO
+#define USE_REGISTERED_IO 1 // 1 = READ_FIXED/WRITE_FIXED on registered files and buffers
+#endif
+#ifndef USE_IOPOLL_RING
+#define USE_IOPOLL_RING 0 // 1 = O_DIRECT file reads/writes go to a polled ring, needs NVMe poll queues
+#endif
 #define WAIT_TIMEOUT_MS 100
 
-static atomic_int req_counter = 0;
+// per worker, every shard owns its ring and counters
+static __thread int multishot_accept = USE_MULTISHOT_ACCEPT;
 
-void reset_req_counter() { atomic_store(&req_counter, 0); }
-int get_req_counter() { return atomic_load(&req_counter); }
-void increment_req_counter() { atomic_fetch_add(&req_counter, 1); }
+// ring fd of worker 0 for IORING_SETUP_ATTACH_WQ, -1 until it is up
+static atomic_int shared_wq_fd = -1;
+
+typedef struct
+{
+    int id;
+    int cpu;
+} worker_args;
+
+// SQE bookkeeping stays with the ring's own thread, see submit_policy_flush()
+void reset_req_counter() { submit_policy_reset(); }
+int get_req_counter() { return submit_policy_pending(); }
+void increment_req_counter() { submit_policy_queued(); }
 
 void make_non_blocking(int socket_fd)
 {
@@ -45,21 +82,14 @@ int add_accept_request(int server_socket, struct io_uring *ring, struct sockaddr
         }
     }
 
-    // initializing connection state for client
-    conn_state *conn = malloc(sizeof(conn_state));
-    memset(conn, 0, sizeof(conn_state));
-    if (posix_memalign((void **)&conn->req_buffer, MY_BLOCK_SIZE, BUFFER_SIZE) != 0)
-    {
-        perror("Failed to allocate aligned buffer");
-        free(conn);
+    // initializing connection state for client, with a buffer ring the first recv brings its own buffer
+    conn_state *conn = conn_alloc(!buf_ring_enabled());
+    if (!conn)
         return CONN_ERROR;
-    }
-    memset(conn->req_buffer, 0, BUFFER_SIZE);
-    conn->file_fd = -1;
     conn->state = ACCEPTING_CONNECTION;
     io_uring_prep_accept(sqe, server_socket, (struct sockaddr *)client_addr,
                          client_len, SOCK_NONBLOCK);
-    io_uring_sqe_set_data(sqe, conn);
+    io_uring_sqe_set_data64(sqe, conn_handle(conn));
     return CONN_ALIVE;
 }
 
@@ -67,13 +97,93 @@ void close_conn(conn_state *conn)
 {
     if (!conn)
         return;
-    if (conn->file_fd != -1)
-        close(conn->file_fd);
+    // kernel still reads req_buffer, finish once the last send_zc notification arrives
+    if (conn->zc_notif_pending > 0)
+    {
+        conn->zc_closing = 1;
+        return;
+    }
+    release_conn_file(conn);
+    put_file(&conn->file_fd, &conn->file_entry);
     if (conn->fd != -1)
         close(conn->fd);
-    if (conn->req_buffer)
-        free(conn->req_buffer);
-    free(conn);
+    if (conn->pipe_fds[0] != -1)
+    {
+        close(conn->pipe_fds[0]);
+        close(conn->pipe_fds[1]);
+    }
+    if (conn->buf_id != -1)
+        recycle_provided_buf(conn);
+    free(conn->carry);
+    free(conn->open_req);
+    conn_free(conn);
+}
+
+conn_state *alloc_conn(int client_socket)
+{
+    // with a buffer ring the first recv brings its own buffer
+    conn_state *conn = conn_alloc(!buf_ring_enabled());
+    if (!conn)
+        return NULL;
+    conn->fd = client_socket;
+    return conn;
+}
+
+int add_multishot_accept_request(int server_socket, struct io_uring *ring)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    if (!sqe)
+    {
+        io_uring_submit(ring);
+        reset_req_counter();
+        sqe = io_uring_get_sqe(ring);
+        if (!sqe)
+        {
+            fprintf(stderr, "Failed to get SQE in add_multishot_accept_request: %s\n", strerror(errno));
+            return CONN_ERROR;
+        }
+    }
+
+    // no sockaddr, the client address is never used
+    io_uring_prep_multishot_accept(sqe, server_socket, NULL, NULL, SOCK_NONBLOCK);
+    io_uring_sqe_set_data64(sqe, ACCEPT_HANDLE);
+    return CONN_ALIVE;
+}
+
+int handle_multishot_accept(int server_socket, struct io_uring *ring, struct io_uring_cqe *cqe)
+{
+    if (cqe->res >= 0)
+    {
+        conn_state *conn = alloc_conn(cqe->res);
+        if (!conn)
+            close(cqe->res);
+        else if (io_uring_func(ring, conn, RECV_REQUEST) < 0)
+            close_conn(conn);
+    }
+    else if (cqe->res == -EINVAL && !(cqe->flags & IORING_CQE_F_MORE))
+    {
+        // kernel < 5.19, fall back to one accept SQE per client
+        fprintf(stderr, "Multishot accept not supported, falling back to single accepts\n");
+        multishot_accept = 0;
+        for (int i = 0; i < 10; i++)
+        {
+            if (add_accept_request(server_socket, ring, NULL, NULL) < 0)
+                return CONN_ERROR;
+            increment_req_counter();
+        }
+        return CONN_ALIVE;
+    }
+    else
+        fprintf(stderr, "Multishot accept failed: %s\n", strerror(-cqe->res));
+
+    // without IORING_CQE_F_MORE the kernel has dropped the accept and it must be re-armed
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        if (add_multishot_accept_request(server_socket, ring) < 0)
+            return CONN_ERROR;
+        increment_req_counter();
+    }
+    return CONN_ALIVE;
 }
 
 void print_sq_poll_kernel_thread_status()
@@ -85,20 +195,21 @@ void print_sq_poll_kernel_thread_status()
         printf("Kernel thread io_uring-sq is not running.\n");
 }
 
-int main()
+void *uring_worker(void *arg)
 {
+    worker_args *w = (worker_args *)arg;
     cpu_set_t cpuset;
     CPU_ZERO(&cpuset);
-    CPU_SET(1, &cpuset); // Pin to core 0
+    CPU_SET(w->cpu, &cpuset);
 
-    if (sched_setaffinity(getpid(), sizeof(cpu_set_t), &cpuset) == -1)
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0)
     {
-        perror("sched_setaffinity");
+        perror("pthread_setaffinity_np");
         // Handle error
     }
     else
     {
-        printf("Process %d pinned to core 1.\n", getpid());
+        printf("Worker %d pinned to core %d.\n", w->id, w->cpu);
     }
 
     int server_socket;
@@ -111,9 +222,10 @@ int main()
     if (server_socket < 0)
     {
         perror("Error creating socket");
-        return 1;
+        return NULL;
     }
 
+    // own listener per worker, SO_REUSEPORT spreads clients over them
     // make the server socket non-blocking
     make_non_blocking(server_socket);
 
@@ -130,27 +242,36 @@ int main()
     {
         perror("Error binding socket");
         close(server_socket);
-        return 1;
+        return NULL;
     }
 
     // LISTEN
     if (listen(server_socket, ACCEPT_BACKLOG) < 0)
     {
         perror("Error listening on socket");
-        return 1;
+        return NULL;
     }
 
     // init io_uring
     memset(&params, 0, sizeof(params));
     // params.flags |= IORING_SETUP_SQPOLL;
     // params.sq_thread_idle = 2000;
-    if (io_uring_queue_init_params(QUEUE_DEPTH, &ring, &params) < 0)
+    if (USE_ATTACH_WQ && w->id > 0)
+    {
+        while (atomic_load(&shared_wq_fd) == -1)
+            sched_yield();
+        params.flags |= IORING_SETUP_ATTACH_WQ;
+        params.wq_fd = atomic_load(&shared_wq_fd);
+    }
+    if (setup_ring(QUEUE_DEPTH, &ring, &params, w->id) < 0)
     {
         perror("Error initializing io_uring");
         close(server_socket);
         exit(1);
-        return 1;
+        return NULL;
     }
+    if (w->id == 0)
+        atomic_store(&shared_wq_fd, ring.ring_fd);
 
     // check if IORING_FEAT_FAST_POLL is supported
     if (!(params.features & IORING_FEAT_FAST_POLL))
@@ -159,33 +280,59 @@ int main()
         exit(0);
     }
 
-    printf("Server listening on PORT %d\n", SERVER_PORT);
+    if (USE_BUF_RING && setup_buf_ring(&ring) < 0)
+        printf("Provided buffer ring unavailable, using per connection buffers\n");
+    if (USE_REGISTERED_IO && setup_registered_io(&ring) < 0)
+        printf("Registered files/buffers unavailable, using plain read/write\n");
+    if (USE_SEND_ZC && setup_send_zc(&ring) < 0)
+        printf("IORING_OP_SEND_ZC not supported, using copying sends\n");
+    if (USE_LINKED_GET && setup_linked_get(&ring) < 0)
+        printf("IORING_FEAT_CQE_SKIP not available, GET chunks are not linked\n");
+    if (USE_IOPOLL_RING && setup_file_ring(&ring) < 0)
+        printf("IOPOLL file ring unavailable, file IO stays on the socket ring\n");
+
+    printf("Worker %d listening on PORT %d, CQ wait: %s\n", w->id, SERVER_PORT, ring_wait_describe());
 
     // ALLOW
-    // 1st connection req
-    struct sockaddr_in client_addr1;
-    socklen_t client_len1 = sizeof(client_addr1);
-    if (add_accept_request(server_socket, &ring, &client_addr1, &client_len1) < 0)
+    if (multishot_accept)
     {
-        perror("Error accepting 1st connection");
-        close(server_socket);
-        exit(1);
-        return 1;
+        // one armed accept covers every incoming client
+        if (add_multishot_accept_request(server_socket, &ring) < 0)
+        {
+            perror("Error arming multishot accept");
+            close(server_socket);
+            exit(1);
+            return NULL;
+        }
+        io_uring_submit(&ring);
     }
-    io_uring_submit(&ring);
-
-    // Pre-seed with multiple accept requests
-    for (int i = 0; i < 10; i++)
+    else
     {
-        if (add_accept_request(server_socket, &ring, &client_addr, &client_len) < 0)
+        // 1st connection req
+        struct sockaddr_in client_addr1;
+        socklen_t client_len1 = sizeof(client_addr1);
+        if (add_accept_request(server_socket, &ring, &client_addr1, &client_len1) < 0)
         {
-            fprintf(stderr, "Failed to add initial accept request\n");
+            perror("Error accepting 1st connection");
             close(server_socket);
-            return 1;
+            exit(1);
+            return NULL;
+        }
+        io_uring_submit(&ring);
+
+        // Pre-seed with multiple accept requests
+        for (int i = 0; i < 10; i++)
+        {
+            if (add_accept_request(server_socket, &ring, NULL, NULL) < 0)
+            {
+                fprintf(stderr, "Failed to add initial accept request\n");
+                close(server_socket);
+                return NULL;
+            }
         }
     }
 
-    printf("SQPOLL thread active (thread ID: %d)\n", print_sq_poll_kernel_thread_status());
+    print_sq_poll_kernel_thread_status();
 
     // struct io_uring_cqe *cqe;
     // struct __kernel_timespec ts = {
@@ -215,33 +362,94 @@ int main()
             perror("io_uring_wait_cqes");
             break;
         }*/
-        io_uring_submit_and_wait(&ring, 1);
+        ring_wait(&ring);
+        ring_stats_tick(w->id);
         struct io_uring_cqe *cqe;
         unsigned cqe_count = 0;
         unsigned head;
         io_uring_for_each_cqe(&ring, head, cqe)
         {
-            conn_state *conn = (conn_state *)io_uring_cqe_get_data(cqe);
-            ssize_t res = cqe->res;
+            if (cqe_count > 0)
+                submit_policy_flush(&ring, 0); // SQEs of the previous completions, the rest go with the wait
+            cqe_count++; // count before any continue, every seen cqe must be advanced
+            uint64_t data = io_uring_cqe_get_data64(cqe);
+            if (data & LINKED_READ_TAG)
+            {
+                // failed/short linked read, the cancelled send cqe behind it closes the conn
+                fprintf(stderr, "Linked GET read failed: %d\n", cqe->res);
+                continue;
+            }
+            if (data == LINK_TIMEOUT_HANDLE)
+                continue; // the op it bounded reports the outcome
+            if (data == ACCEPT_HANDLE)
+            {
+                if (handle_multishot_accept(server_socket, &ring, cqe) < 0)
+                    fprintf(stderr, "Failed to re-arm multishot accept\n");
+                continue;
+            }
 
+            // NULL once the conn was closed, its slot may already serve another client
+            conn_state *conn = conn_lookup(data);
+            ssize_t res = cqe->res;
             if (!conn)
                 continue;
 
+            if (cqe->flags & IORING_CQE_F_NOTIF)
+            {
+                int status = handle_send_zc_notif(&ring, conn);
+                if (status == CONN_CLOSED || status == CONN_ERROR)
+                    close_conn(conn);
+                continue;
+            }
+            if (cqe->flags & IORING_CQE_F_MORE)
+                conn->zc_notif_pending++; // send_zc result, its notification follows
+
+            if (cqe->flags & IORING_CQE_F_BUFFER)
+                adopt_provided_buf(conn, cqe);
+
+            if (conn->state == OPENING_FILE || conn->state == STATING_FILE)
+            {
+                // file lookup, not a socket op: errors are answered by the handler and statx succeeds with 0
+                int status = handle_requests_uring(&ring, conn, res);
+                if (status == CONN_CLOSED || status == CONN_ERROR)
+                    close_conn(conn);
+                continue;
+            }
+
             if (res < 0)
             {
+                if (res == -ECANCELED)
+                {
+                    // its linked timeout fired, or the linked read ahead of it failed
+                    if (conn->state == READING_HEADER && conn->bytes_read > 0)
+                        send_static_response(conn->fd, RESP_REQUEST_TIMEOUT);
+                    close_conn(conn);
+                    continue;
+                }
                 if (res == -EAGAIN || res == -EWOULDBLOCK)
                     continue;
+                if (res == -EOPNOTSUPP && file_ring_fallback(&ring, conn) == CONN_ALIVE)
+                    continue; // polled I/O unsupported for this file, resubmitted on this ring
+                if (res == -ENOBUFS)
+                {
+                    // buffer ring drained, resubmitting into it would just spin until a buffer comes back
+                    if (borrow_recv_buffer(conn) < 0 || io_uring_func(&ring, conn, RECV_REQUEST) < 0)
+                        close_conn(conn);
+                    continue;
+                }
                 fprintf(stderr, "Async request failed: %s for state: %d\n",
                         strerror(-cqe->res), conn->state);
-                send_response(conn->fd, "HTTP/1.1 400 Bad Request", "text/plain", "Malformed Request.");
+                send_static_response(conn->fd, RESP_MALFORMED);
                 close_conn(conn);
+                continue;
             }
             else if (res == 0)
             {
                 fprintf(stderr, "Client disconnected: %s for state: %d\n",
                         strerror(-cqe->res), conn->state);
-                send_response(conn->fd, "HTTP/1.1 400 Bad Request", "text/plain", "Client Disconnected");
+                send_static_response(conn->fd, RESP_CLIENT_DISCONNECTED);
                 close_conn(conn);
+                continue;
             }
 
             // printf("Connection accepted from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
@@ -256,10 +464,8 @@ int main()
                     close_conn(conn);
                     continue;
                 }
-                struct sockaddr_in client_addr;
-                socklen_t client_len = sizeof(client_addr);
-
-                if (add_accept_request(server_socket, &ring, &client_addr, &client_len) < 0)
+                // client address is unused, don't hand the kernel a stack slot that goes out of scope
+                if (add_accept_request(server_socket, &ring, NULL, NULL) < 0)
                     continue;
             }
             else
@@ -270,12 +476,11 @@ int main()
                 {
                     if (status == CONN_ERROR)
                     {
-                        send_response(conn->fd, "HTTP/1.1 500 Internal Server Error", "text/plain", "Internal Server Error");
+                        send_static_response(conn->fd, RESP_INTERNAL_ERROR);
                     }
                     close_conn(conn);
                 }
             }
-            cqe_count++;
         }
 
         io_uring_cq_advance(&ring, cqe_count);
@@ -295,4 +500,37 @@ int main()
     io_uring_queue_exit(&ring);
     close(server_socket);
     printf("Connection closed.\n");
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    // optional worker count, one shard (listener + ring + conns) per core
+    int num_workers = argc > 1 ? atoi(argv[1]) : 1;
+    long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_workers < 1 || num_workers > MAX_WORKERS)
+    {
+        fprintf(stderr, "Worker count must be between 1 and %d\n", MAX_WORKERS);
+        return 1;
+    }
+
+    init_static_responses(); // before the workers start, they only read the table
+    if (io_pool_init(IO_POOL_PREFAULT) < 0) // shared by every shard
+        return 1;
+    cache_set_workers(num_workers);
+    pthread_t tids[MAX_WORKERS];
+    worker_args args[MAX_WORKERS];
+    for (int i = 0; i < num_workers; i++)
+    {
+        args[i].id = i;
+        args[i].cpu = (FIRST_CORE + i) % num_cores;
+        if (pthread_create(&tids[i], NULL, uring_worker, &args[i]) != 0)
+        {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    for (int i = 0; i < num_workers; i++)
+        pthread_join(tids[i], NULL);
+    return 0;
 }
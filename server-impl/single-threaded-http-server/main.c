@@ -9,6 +9,13 @@ int main()
     int server_socket;
     struct sockaddr_in server_addr;
 
+    init_static_responses();
+
+    // one connection at a time, the same io buffer serves all of them
+    char *req_buffer;
+    if (io_pool_init(1) < 0 || !(req_buffer = io_buffer_get()))
+        return 1;
+
     // CREATE
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket < 0)
@@ -50,7 +57,8 @@ int main()
 
         while (accept_count < MAX_PENDING_ACCEPTS)
         {
-
+            struct sockaddr_in client_addr;
+            socklen_t client_len = sizeof(client_addr);
             int client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
             if (client_socket < 0)
             {
@@ -69,22 +77,14 @@ int main()
         {
             // printf("Connection accepted from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
 
-            int file_fd;
-            char *req_buffer;
-            if (posix_memalign((void **)&req_buffer, MY_BLOCK_SIZE, BUFFER_SIZE) != 0)
-            {
-                perror("Failed to allocate aligned buffer");
-                close(accepted_sockets[i]);
-                continue;
-            }
-            memset(req_buffer, 0, BUFFER_SIZE);
+            int file_fd = -1;
             int res = handle_blocking_requests(accepted_sockets[i], &file_fd, req_buffer);
             if (res == CONN_ERROR)
             {
-                send_response(accepted_sockets[i], "HTTP/1.1 500 Internal Server Error", "text/plain", "Internal Server Error");
+                send_static_response(accepted_sockets[i], RESP_INTERNAL_ERROR);
             }
-            close(file_fd);
-            free(req_buffer);
+            if (file_fd != -1)
+                close(file_fd);
             close(accepted_sockets[i]);
         }
     }